@@ -0,0 +1,442 @@
+/**
+ * @file bench.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Loopback benchmark of the server and the client, used by make bench.
+ * 
+ * @details Starts a server and the given number of clients on the loopback interface, writes the given number of bytes
+ * of synthetic lines to the input of every client and reads them back from the output of the server.
+ * Every line starts with the monotonic time it is written at, so the latency of a message is the time from the input
+ * of the client to the output of the server, queueing included. The server writes its output with --flush-delay BENCH_FLUSH_DELAY,
+ * which bounds how long a delivered line waits in its buffer and is part of the latency. A --flush-delay in the transport options overrides it.
+ * 
+ * Prints one JSON line per run with the goodput, the latency percentiles, the CPU time of the programs per GB
+ * and the share of the packets sent by the clients that were retransmissions, read from their SIGUSR1 snapshot.
+ * 
+ * Usage: benchmark [-c clients] [-n bytes per client] [-l line length] [-p port] [-t timeout] [-- transport options]
+ * 
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "log.h"
+
+/** Default line length, below the segment size so the lines of different clients are not mixed in the output of the server */
+#define BENCH_LINE_SIZE 1000
+/** Length of the time stamp at the start of a line, the shorter lines are not timed */
+#define BENCH_STAMP_SIZE 21
+/** Seconds a run may take */
+#define BENCH_TIMEOUT 600
+/** Flush delay of the server output in microseconds, the default of the programs */
+#define BENCH_FLUSH_DELAY "1000"
+
+/**
+ * @struct bench_client
+ * 
+ * @brief A client process and its input that is not written yet
+ * 
+ */
+struct bench_client {
+	pid_t pid;
+	/** Write end of the standard input of the client */
+	int in;
+	/** Bytes of lines not generated yet */
+	uint64_t left;
+	/** Line being written */
+	char *line;
+	size_t pos;
+	size_t len;
+	/** File the standard error of the client goes to, its snapshot is read from there */
+	char stats_path[64];
+};
+
+/**
+ * @brief Returns the monotonic time in nanoseconds
+ * 
+ * @return uint64_t 
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Starts a program with the given standard input, output and error descriptors. Returns its pid.
+ * 
+ * @param argv 
+ * @param in 
+ * @param out 
+ * @param err 
+ * @return pid_t 
+ */
+static pid_t spawn(char **argv, int in, int out, int err)
+{
+	pid_t pid = fork();
+	if (pid == -1)
+		log_print(ERROR, "Cannot fork");
+	if (pid)
+		return pid;
+
+	dup2(in, STDIN_FILENO);
+	dup2(out, STDOUT_FILENO);
+	dup2(err, STDERR_FILENO);
+	execvp(argv[0], argv);
+	_exit(127);
+}
+
+/**
+ * @brief Generates the next line of the given client. Lines are never a single newline, that is the termination input.
+ * 
+ * @param client 
+ * @param line_size 
+ */
+static void next_line(struct bench_client *client, size_t line_size)
+{
+	size_t len = client->left < line_size ? client->left : line_size;
+	/** Do not leave a single byte for the last line */
+	if (client->left - len == 1)
+		len--;
+
+	memset(client->line, 'x', len - 1);
+	if (len > BENCH_STAMP_SIZE) {
+		char stamp[BENCH_STAMP_SIZE + 1];
+		snprintf(stamp, sizeof(stamp), "%020lu ",
+			 (unsigned long)now_ns());
+		memcpy(client->line, stamp, BENCH_STAMP_SIZE);
+	}
+	client->line[len - 1] = '\n';
+	client->pos = 0;
+	client->len = len;
+	client->left -= len;
+}
+
+/**
+ * @brief Writes the lines of the given client until its pipe is full or it has nothing left. Returns 1 when done.
+ * 
+ * @param client 
+ * @param line_size 
+ * @return int 
+ */
+static int feed_client(struct bench_client *client, size_t line_size)
+{
+	while (1) {
+		if (client->pos == client->len) {
+			if (!client->left)
+				return 1;
+			next_line(client, line_size);
+		}
+
+		ssize_t n = write(client->in, client->line + client->pos,
+				  client->len - client->pos);
+		if (n == -1)
+			return errno == EAGAIN ? 0 : -1;
+		client->pos += n;
+	}
+}
+
+/**
+ * @brief Compares two latencies for qsort
+ * 
+ * @param a 
+ * @param b 
+ * @return int 
+ */
+static int compare_latency(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Reads the retransmissions and sent packets from the snapshot the client printed to its standard error
+ * 
+ * @param path 
+ * @param retransmissions 
+ * @param packets 
+ */
+static void read_client_stats(const char *path, unsigned long *retransmissions,
+			      unsigned long *packets)
+{
+	char buf[4096];
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+
+	char *sent = strstr(buf, "\"sent\":{\"packets\":");
+	char *retrans = strstr(buf, "\"retransmissions\":");
+	if (!sent || !retrans)
+		return;
+	*packets += strtoul(sent + strlen("\"sent\":{\"packets\":"), 0, 10);
+	*retransmissions +=
+		strtoul(retrans + strlen("\"retransmissions\":"), 0, 10);
+}
+
+int main(int argc, char *argv[])
+{
+	int clients = 1;
+	uint64_t bytes = 1 << 20;
+	size_t line_size = BENCH_LINE_SIZE;
+	int port = 20000 + getpid() % 10000;
+	int timeout = BENCH_TIMEOUT;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:l:p:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'n':
+			bytes = strtoull(optarg, 0, 10);
+			break;
+		case 'l':
+			line_size = strtoul(optarg, 0, 10);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		default:
+			log_print(ERROR,
+				  "Usage: benchmark [-c clients] [-n bytes per client] [-l line length] [-p port] [-t timeout] [-- transport options]");
+		}
+	}
+	if (clients < 1 || bytes < 2 || line_size < 2)
+		log_print(ERROR, "Wrong arguments");
+	char **transport = argv + optind;
+	int transport_count = argc - optind;
+
+	signal(SIGPIPE, SIG_IGN);
+	char port_str[16];
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	int null_fd = open("/dev/null", O_RDWR);
+
+	/** Server: the input pipe is kept open and empty, the output and the log are read */
+	int server_in[2], server_out[2], server_err[2];
+	if (pipe(server_in) == -1 || pipe(server_out) == -1 ||
+	    pipe(server_err) == -1)
+		log_print(ERROR, "Cannot create pipes");
+	char **server_argv = calloc(transport_count + 5, sizeof(char *));
+	int a = 0;
+	server_argv[a++] = "./server";
+	server_argv[a++] = "--flush-delay";
+	server_argv[a++] = BENCH_FLUSH_DELAY;
+	for (int i = 0; i < transport_count; i++)
+		server_argv[a++] = transport[i];
+	server_argv[a++] = port_str;
+	pid_t server = spawn(server_argv, server_in[0], server_out[1],
+			     server_err[1]);
+	close(server_in[0]);
+	close(server_out[1]);
+	close(server_err[1]);
+	fcntl(server_out[0], F_SETFL, O_NONBLOCK);
+	fcntl(server_err[0], F_SETFL, O_NONBLOCK);
+	usleep(100000);
+
+	/** Clients: only errors are logged, so the standard error holds the snapshot */
+	char dir[] = "/tmp/bench.XXXXXX";
+	if (!mkdtemp(dir))
+		log_print(ERROR, "Cannot create the stats directory");
+	char **client_argv = calloc(transport_count + 7, sizeof(char *));
+	a = 0;
+	client_argv[a++] = "./client";
+	client_argv[a++] = "--log-level";
+	client_argv[a++] = "error";
+	for (int i = 0; i < transport_count; i++)
+		client_argv[a++] = transport[i];
+	client_argv[a++] = "127.0.0.1";
+	client_argv[a++] = port_str;
+
+	struct bench_client *list = calloc(clients, sizeof(*list));
+	for (int i = 0; i < clients; i++) {
+		int in[2];
+		if (pipe(in) == -1)
+			log_print(ERROR, "Cannot create pipes");
+		snprintf(list[i].stats_path, sizeof(list[i].stats_path),
+			 "%s/%d", dir, i);
+		int err = open(list[i].stats_path, O_CREAT | O_RDWR | O_TRUNC,
+			       0600);
+		list[i].pid = spawn(client_argv, in[0], null_fd, err);
+		close(in[0]);
+		close(err);
+		list[i].in = in[1];
+		fcntl(list[i].in, F_SETFL, O_NONBLOCK);
+		list[i].left = bytes;
+		list[i].line = malloc(line_size);
+	}
+
+	/** Wait for every connection before sending, the server stops accepting once the last active one closes */
+	char buf[65536];
+	char log_line[4096];
+	size_t log_len = 0;
+	int connected = 0;
+	uint64_t deadline = now_ns() + (uint64_t)timeout * 1000000000;
+	while (connected < clients && now_ns() < deadline) {
+		struct pollfd pfd = { .fd = server_err[0], .events = POLLIN };
+		poll(&pfd, 1, 100);
+		ssize_t n;
+		while ((n = read(server_err[0], buf, sizeof(buf))) > 0) {
+			for (ssize_t i = 0; i < n; i++) {
+				if (buf[i] != '\n') {
+					if (log_len < sizeof(log_line) - 1)
+						log_line[log_len++] = buf[i];
+					continue;
+				}
+				log_line[log_len] = '\0';
+				if (strstr(log_line, "New connection added"))
+					connected++;
+				log_len = 0;
+			}
+		}
+	}
+	if (connected < clients)
+		log_print(ERROR, "Only %d of %d clients connected", connected,
+			  clients);
+
+	/** Feed the clients and read the server output until every byte arrives */
+	uint64_t total = bytes * clients, received = 0;
+	size_t lat_count = 0, lat_capacity = 1024;
+	uint32_t *latencies = malloc(lat_capacity * sizeof(uint32_t));
+	char partial[BENCH_STAMP_SIZE];
+	size_t partial_len = 0;
+	int fed = 0;
+	struct pollfd *pfds = calloc(clients + 2, sizeof(struct pollfd));
+	uint64_t start = now_ns(), end = start;
+	while (received < total && now_ns() < deadline) {
+		int count = 0;
+		pfds[count++] = (struct pollfd){ .fd = server_out[0],
+						 .events = POLLIN };
+		pfds[count++] = (struct pollfd){ .fd = server_err[0],
+						 .events = POLLIN };
+		for (int i = 0; i < clients && fed < clients; i++)
+			if (list[i].left || list[i].pos < list[i].len)
+				pfds[count++] = (struct pollfd){
+					.fd = list[i].in, .events = POLLOUT
+				};
+		poll(pfds, count, 100);
+
+		for (int i = 0; i < clients && fed < clients; i++) {
+			if (!list[i].left && list[i].pos == list[i].len)
+				continue;
+			int res = feed_client(&list[i], line_size);
+			if (res == -1)
+				log_print(ERROR, "Client %d exited early", i);
+			fed += res;
+		}
+
+		/** The log of the server is only drained */
+		while (read(server_err[0], buf, sizeof(buf)) > 0)
+			;
+
+		ssize_t n;
+		while ((n = read(server_out[0], buf, sizeof(buf))) > 0) {
+			uint64_t now = end = now_ns();
+			received += n;
+			for (ssize_t i = 0; i < n; i++) {
+				/** Only the start of a line is kept, for its time stamp */
+				if (buf[i] != '\n') {
+					if (partial_len < BENCH_STAMP_SIZE)
+						partial[partial_len++] = buf[i];
+					continue;
+				}
+				if (partial_len == BENCH_STAMP_SIZE &&
+				    partial[BENCH_STAMP_SIZE - 1] == ' ') {
+					uint64_t sent = strtoull(partial, 0, 10);
+					if (sent && sent <= now) {
+						if (lat_count == lat_capacity) {
+							lat_capacity *= 2;
+							latencies = realloc(
+								latencies,
+								lat_capacity *
+									sizeof(uint32_t));
+						}
+						uint64_t us = (now - sent) / 1000;
+						latencies[lat_count++] =
+							us > UINT32_MAX ?
+								UINT32_MAX :
+								us;
+					}
+				}
+				partial_len = 0;
+			}
+		}
+	}
+	double seconds = (end - start) / 1e9;
+
+	/** Ask the clients for their counters before they close */
+	unsigned long retransmissions = 0, packets = 0;
+	for (int i = 0; i < clients; i++)
+		kill(list[i].pid, SIGUSR1);
+	usleep(200000);
+	for (int i = 0; i < clients; i++)
+		read_client_stats(list[i].stats_path, &retransmissions,
+				  &packets);
+
+	/** Two blank lines close the clients, the server exits after the last one */
+	for (int i = 0; i < clients; i++) {
+		fcntl(list[i].in, F_SETFL, 0);
+		write(list[i].in, "\n\n", 2);
+	}
+	uint64_t exit_deadline = now_ns() + 10 * 1000000000ULL;
+	int alive = clients + 1;
+	while (alive && now_ns() < exit_deadline) {
+		while (read(server_err[0], buf, sizeof(buf)) > 0 ||
+		       read(server_out[0], buf, sizeof(buf)) > 0)
+			;
+		pid_t pid = waitpid(-1, 0, WNOHANG);
+		if (pid > 0)
+			alive--;
+		else
+			usleep(10000);
+	}
+	if (alive) {
+		kill(server, SIGKILL);
+		for (int i = 0; i < clients; i++)
+			kill(list[i].pid, SIGKILL);
+		while (waitpid(-1, 0, 0) > 0)
+			;
+	}
+	for (int i = 0; i < clients; i++)
+		unlink(list[i].stats_path);
+	rmdir(dir);
+
+	struct rusage usage;
+	getrusage(RUSAGE_CHILDREN, &usage);
+	double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		     (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+	qsort(latencies, lat_count, sizeof(uint32_t), &compare_latency);
+	uint32_t p50 = 0, p99 = 0, p999 = 0;
+	if (lat_count) {
+		p50 = latencies[lat_count * 50 / 100];
+		p99 = latencies[lat_count * 99 / 100];
+		p999 = latencies[lat_count * 999 / 1000];
+	}
+
+	printf("{\"clients\":%d,\"bytes_per_client\":%lu,\"line\":%zu,\"options\":\"",
+	       clients, (unsigned long)bytes, line_size);
+	for (int i = 0; i < transport_count; i++)
+		printf("%s%s", i ? " " : "", transport[i]);
+	printf("\",\"complete\":%s,\"received\":%lu,\"seconds\":%.6f,\"goodput_mbps\":%.3f,"
+	       "\"latency_us\":{\"count\":%zu,\"p50\":%u,\"p99\":%u,\"p999\":%u},"
+	       "\"cpu_s_per_gb\":%.3f,\"retransmit_ratio\":%.6f}\n",
+	       received >= total ? "true" : "false", (unsigned long)received,
+	       seconds, seconds > 0 ? received * 8 / seconds / 1e6 : 0,
+	       lat_count, p50, p99, p999, received ? cpu / (received / 1e9) : 0,
+	       packets ? (double)retransmissions / packets : 0);
+
+	return received >= total ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,152 @@
+/**
+ * @file cc.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Congestion control algorithms
+ * 
+ */
+
+#include <string.h>
+
+#include "cc.h"
+
+/**
+ * @brief Reno initial window: INITIAL_CWND packets and slow start until the first loss
+ * 
+ * @param cc 
+ */
+static void reno_init(struct congestion *cc)
+{
+	cc->cwnd = INITIAL_CWND;
+	cc->ssthresh = MAX_CWND;
+	cc->acked = 0;
+}
+
+/**
+ * @brief Reno window growth. One packet per acked packet in slow start, one packet per window in congestion avoidance.
+ * 
+ * @param cc 
+ * @param acked 
+ */
+static void reno_on_ack(struct congestion *cc, unsigned int acked)
+{
+	/** Slow start, the part of the acked packets beyond ssthresh is counted for congestion avoidance */
+	if (cc->cwnd < cc->ssthresh) {
+		unsigned int grow = cc->ssthresh - cc->cwnd;
+		if (grow > acked)
+			grow = acked;
+		cc->cwnd += grow;
+		acked -= grow;
+	}
+
+	/** Additive increase */
+	cc->acked += acked;
+	while (cc->acked >= cc->cwnd) {
+		cc->acked -= cc->cwnd;
+		cc->cwnd++;
+	}
+
+	if (cc->cwnd > MAX_CWND)
+		cc->cwnd = MAX_CWND;
+}
+
+/**
+ * @brief Reno multiplicative decrease, the window is halved
+ * 
+ * @param cc 
+ */
+static void reno_on_loss(struct congestion *cc)
+{
+	cc->ssthresh = cc->cwnd / 2 > 2 ? cc->cwnd / 2 : 2;
+	cc->cwnd = cc->ssthresh;
+	cc->acked = 0;
+}
+
+/**
+ * @brief Reno timeout reaction, the window collapses to one packet and slow start begins again
+ * 
+ * @param cc 
+ */
+static void reno_on_timeout(struct congestion *cc)
+{
+	cc->ssthresh = cc->cwnd / 2 > 2 ? cc->cwnd / 2 : 2;
+	cc->cwnd = 1;
+	cc->acked = 0;
+}
+
+/** Slow start, additive increase and multiplicative decrease (RFC 5681) */
+const struct cc_ops cc_reno = {
+	.name = "reno",
+	.init = reno_init,
+	.on_ack = reno_on_ack,
+	.on_loss = reno_on_loss,
+	.on_timeout = reno_on_timeout,
+};
+
+/**
+ * @brief Fixed window, only the receiver window limits the sender
+ * 
+ * @param cc 
+ */
+static void fixed_init(struct congestion *cc)
+{
+	cc->cwnd = cc->ssthresh = MAX_CWND;
+	cc->acked = 0;
+}
+
+/**
+ * @brief Fixed window does not react to any event
+ * 
+ * @param cc 
+ * @param acked 
+ */
+static void fixed_on_ack(struct congestion *cc, unsigned int acked)
+{
+}
+
+/**
+ * @brief Fixed window does not react to any event
+ * 
+ * @param cc 
+ */
+static void fixed_on_event(struct congestion *cc)
+{
+}
+
+/** No congestion control, the sender always uses the whole receiver window */
+const struct cc_ops cc_fixed = {
+	.name = "fixed",
+	.init = fixed_init,
+	.on_ack = fixed_on_ack,
+	.on_loss = fixed_on_event,
+	.on_timeout = fixed_on_event,
+};
+
+/** Algorithms that can be selected by name */
+static const struct cc_ops *algorithms[] = { &cc_reno, &cc_fixed };
+
+/**
+ * @brief Returns the algorithm with the given name, NULL if there is none
+ * 
+ * @param name 
+ * @return const struct cc_ops* 
+ */
+const struct cc_ops *find_cc(const char *name)
+{
+	for (int i = 0; i < sizeof(algorithms) / sizeof(*algorithms); i++)
+		if (!strcmp(algorithms[i]->name, name))
+			return algorithms[i];
+
+	return NULL;
+}
+
+/**
+ * @brief Initializes the given state with the given algorithm
+ * 
+ * @param cc 
+ * @param ops 
+ */
+void init_congestion(struct congestion *cc, const struct cc_ops *ops)
+{
+	cc->ops = ops;
+	ops->init(cc);
+}
@@ -0,0 +1,64 @@
+/**
+ * @file cc.h
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Congestion control interface and algorithms.
+ * 
+ */
+
+#ifndef __CC__
+#define __CC__
+
+#include <stdint.h>
+
+/** Initial congestion window in packets (RFC 6928) */
+#define INITIAL_CWND 10
+/** Largest congestion window in packets */
+#define MAX_CWND 65535
+
+struct congestion;
+
+/**
+ * @struct cc_ops
+ * 
+ * @brief A congestion control algorithm. The callbacks update the window in the given state.
+ * 
+ * @details Callbacks are called with the lock of the queue that owns the state held.
+ * 
+ */
+struct cc_ops {
+	/** Name used to select the algorithm with --cc */
+	const char *name;
+	/** Sets the initial window */
+	void (*init)(struct congestion *cc);
+	/** Called when a cumulative ack evicts acked packets from the queue */
+	void (*on_ack)(struct congestion *cc, unsigned int acked);
+	/** Called when a loss is detected without a timeout, e.g. with duplicate acks */
+	void (*on_loss)(struct congestion *cc);
+	/** Called when the retransmission timer expires */
+	void (*on_timeout)(struct congestion *cc);
+};
+
+/**
+ * @struct congestion
+ * 
+ * @brief Congestion control state of a sender. The window is counted in packets.
+ * 
+ */
+struct congestion {
+	const struct cc_ops *ops;
+	/** Congestion window and slow start threshold */
+	unsigned int cwnd;
+	unsigned int ssthresh;
+	/** Packets acked since the window last grew in congestion avoidance */
+	unsigned int acked;
+};
+
+/** Available algorithms */
+extern const struct cc_ops cc_reno;
+extern const struct cc_ops cc_fixed;
+
+/** These functions will be explained in cc.c */
+const struct cc_ops *find_cc(const char *name);
+void init_congestion(struct congestion *cc, const struct cc_ops *ops);
+
+#endif // !__CC__
@@ -6,15 +6,17 @@
  */
 
 #include "conn.h"
+#include "file.h"
+#include "io.h"
 #include "log.h"
+#include "options.h"
 
-/** Mutex and conditions for sender and receiver thread synchronization */
+/** Mutex and condition signaled when the connection is established */
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t established_cond = PTHREAD_COND_INITIALIZER;
 
-/** Mutex and conditions setting timeout */
-pthread_mutex_t timeout_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t timeout_cond = PTHREAD_COND_INITIALIZER;
+/** Wakes the sender thread up when packets are added to the queue or acked */
+struct wakeup sender_wakeup;
 
 /** Packet queue; packets that will be sent.
  * Detailed explanation of queueing is in conn.h */
@@ -25,37 +27,45 @@ struct packet_queue queue;
 int sockfd = -1;
 /** Set when the connection is established */
 char connection_exists = 0;
+/** Payload size, proposed with the init packet and lowered by the server's response */
+unsigned short seg_size = MAX_PAYLOAD_SIZE;
 /** Termination variable. When set, shows that the program is in termination sequence */
 char terminate = 0;
+/** File sent with --file */
+struct mapped_file input;
+/** Sequence number expected from the server */
+unsigned int exp_seq_num = 1;
+/** Out of order packets from the server, used in Selective Repeat mode */
+struct reorder_buffer reorder;
+/** Ack held back until more packets arrive, explained in conn.c */
+struct delayed_ack delayed;
+/** Counters of the datagrams received from the server, explained in stats.h */
+struct recv_stats recv_stats;
+/** Data of the server waiting for the standard output, explained in file.h */
+struct delivery_buffer delivery;
+/** Where the data of the server goes, the delivery buffer or NULL for the --output file */
+struct delivery_buffer *output_buffer = 0;
 
 /**
- * @brief Wait for signal or timeout
+ * @brief Wait for signal or until the given monotonic deadline in microseconds
  * 
- * @param time 
+ * @param deadline 
  */
-void wait_or_signal(long time)
+void wait_or_signal(uint64_t deadline)
 {
-	struct timespec ts;
-	clock_gettime(CLOCK_REALTIME, &ts);
-
-	ts.tv_sec += time / 1000;
-	long ns_left = (time % 1000) * 1000000;
-	long left_limit = 1000000000 - ts.tv_nsec;
-
-	if (ns_left > left_limit) {
-		ts.tv_sec++;
-		ts.tv_nsec = ns_left - left_limit;
-	} else {
-		ts.tv_nsec += ns_left;
-	}
+	if (!wakeup_wait(&sender_wakeup, deadline))
+		log_print(DEBUG, "Timed out, sending packages again");
+}
 
-	pthread_mutex_lock(&timeout_mutex);
-	int res = pthread_cond_timedwait(&timeout_cond, &timeout_mutex, &ts);
-	if (res == ETIMEDOUT)
-		log_print(LOG, "Timed out, sending packages again");
-	else if (res)
-		log_print(ERROR, "Timed wait error");
-	pthread_mutex_unlock(&timeout_mutex);
+/**
+ * @brief Logs the packet pool counters of the queue
+ * 
+ */
+void log_pool_stats()
+{
+	struct pool_stats stats = queue_pool_stats(&queue);
+	log_print(INFO, "Queue pool: %lu hits, %lu misses, high water %u",
+		  stats.hits, stats.misses, stats.high_water);
 }
 
 /**
@@ -66,55 +76,61 @@ void wait_or_signal(long time)
  */
 void *send_packets(void *args)
 {
-	log_print(LOG, "Send thread created, waiting for turn");
+	log_print(INFO, "Send thread created, waiting for turn");
 
 	/** Get the server address */
 	struct addrinfo *target = *((struct addrinfo **)args);
 
+	/** Window packets are sent in batches */
+	struct io_batch tx;
+	io_batch_init(&tx, options.batch_size);
+
 	/** Run until the program termination */
 	while (1) {
 		while (queue.size) {
-			int i = 0;
-			/** Get the lock to prevent the synchronization issues with the receiver thread acknowledge */
-			pthread_mutex_lock(&mutex);
-			/** Iterate over the queue until the end of the queue or the window size */
-			for (struct packet_t *head = queue.head;
-			     head && i < WINDOW_SIZE; head = head->next, i++) {
-				/** Set last sent as the sequence number, this will eventually be equal to the last sent in the window.
-				 * No duplicate sequence numbers occur using this var because all threads using this var is locked.
-				 */
-				queue.last_sent = head->data.seq_num;
-				log_print(LOG, "Sending the packet %d in queue",
-					  head->data.seq_num);
-				/** Send packets to server. If there is an error, exit with error message */
-				int bytes_sent = 0;
-				if ((bytes_sent =
-					     sendto(sockfd, &head->data,
-						    sizeof(struct packet_data),
-						    0, target->ai_addr,
-						    target->ai_addrlen)) == -1)
-					log_print(ERROR, "Cannot send packet");
-				log_print(LOG, "Sent %d bytes to server",
-					  bytes_sent);
-			}
-			pthread_mutex_unlock(&mutex);
+			uint64_t deadline;
+			/** Hold the queue lock, the receiver thread acks and the input thread adds to the window meanwhile */
+			pthread_mutex_lock(&queue.mutex);
+			/** Send the packets in the window that are not sent yet or timed out, explanation in conn.c */
+			int bytes_sent = send_window(&queue, options.mode, sockfd,
+						     &tx, target->ai_addr,
+						     target->ai_addrlen,
+						     &deadline);
+			unsigned int window = queue_window(&queue);
+			pthread_mutex_unlock(&queue.mutex);
+			if (bytes_sent == -1)
+				log_print(ERROR, "Cannot send packet");
+			if (bytes_sent)
+				log_print(DEBUG, "Sent %d bytes to server, window %u",
+					  bytes_sent, window);
 
-			/** Wait 100ms or or ack signal.
-			 * If continues with a signal, it is guaranteed that some packets are acked and evicted from the queue,
-			 * meaning that the window slided.
+			/** Wait until the next retransmission or a signal.
+			 * If continues with a signal, it is guaranteed that some packets are acked or added,
+			 * meaning that the window slided, a selectively acked packet will not be sent again or new packets may fit.
 			 */
-			wait_or_signal(100);
+			wait_or_signal(deadline);
 		}
 
-		/** If the queue becomes empty, wait packets to be added to the queue */
-		pthread_mutex_lock(&mutex);
-		pthread_cond_wait(&cond, &mutex);
-		pthread_mutex_unlock(&mutex);
+		/** If the queue becomes empty, wait packets to be added to the queue.
+		 * A wakeup signaled after the loop checked the size stays pending, so it is not missed.
+		 */
+		while (!queue.size)
+			wakeup_wait(&sender_wakeup, 0);
 	}
 
 	pthread_exit(EXIT_SUCCESS);
 }
 
+/**
+ * @brief Wakes up the send_packets thread when packets are added to the queue
+ * 
+ * @param args 
+ */
+void wake_sender(void *args)
+{
+	wakeup_signal(&sender_wakeup);
+}
+
 /**
  * @brief Thread for getting user input. Adds packets to the queue.
  * 
@@ -126,72 +142,241 @@ void *read_input(void *args)
 	char terminate_read = 0;
 	char *line = 0;
 	size_t line_len = 0;
-	/** Run until the program termination.
-	 * Conditions for this thread is to have two or more blank lines or being in the termination sequence
-	 */
-	while (terminate_read < 2 && !terminate) {
-		int num_read = getline(&line, &line_len, stdin);
-		/** Count the number of empty lines */
-		if (!num_read || !strcmp(line, "\n")) {
-			terminate_read++;
-		} else {
-			terminate_read = 0;
-			/** Get the actual line length */
-			line_len = strlen(line);
-			/** Divide the line into packets.
-			 * Iterate over all segments and copy PAYLOAD_SIZE sized data to packet data.
-			 */
-			for (int i = 0; i < line_len; i += PAYLOAD_SIZE) {
-				struct packet_data data;
-				memset(data.char_seq, '\0', PAYLOAD_SIZE);
-				if (i + PAYLOAD_SIZE < line_len)
-					strncpy(data.char_seq, line + i,
-						PAYLOAD_SIZE);
-				else
-					strncpy(data.char_seq, line + i,
-						line_len - i);
-				add_packet(&queue, &data);
-				log_print(LOG, "Adding %s to data", line + i);
-			}
-			if (connection_exists && queue.size >= 1) {
+
+	/** Packets are segmented with the negotiated size, wait for the connection */
+	pthread_mutex_lock(&mutex);
+	while (!connection_exists)
+		pthread_cond_wait(&established_cond, &mutex);
+	pthread_mutex_unlock(&mutex);
+
+	/** A mapped file is queued in bulk and sent to its end before the termination */
+	if (options.file) {
+		queue_file(&queue, &input, seg_size, &wake_sender, 0);
+		wait_queue_empty(&queue);
+	} else {
+		/** Run until the program termination.
+		 * Conditions for this thread is to have two or more blank lines or being in the termination sequence
+		 */
+		while (terminate_read < 2 && !terminate) {
+			int num_read = getline(&line, &line_len, stdin);
+			/** Count the number of empty lines */
+			if (!num_read || !strcmp(line, "\n")) {
+				terminate_read++;
+			} else {
+				terminate_read = 0;
+				/** Get the actual line length */
+				line_len = strlen(line);
+				/** Divide the line into packets.
+				 * Iterate over all segments and copy up to the negotiated segment size of data to packet data.
+				 */
+				unsigned short segment = seg_size;
+				for (int i = 0; i < line_len; i += segment) {
+					struct packet_data data;
+					data.is_ack = 0;
+					data.init_conn = 0;
+					data.terminate_conn = 0;
+					data.len = line_len - i < segment ?
+							   line_len - i :
+							   segment;
+					memcpy(data.char_seq, line + i, data.len);
+					/** Wait for the acks when the send buffer is full, waking the sender up for what is queued */
+					if (queue.size >= queue.limit) {
+						wake_sender(0);
+						wait_queue_space(&queue);
+					}
+					add_packet(&queue, &data);
+					log_print(TRACE, "Adding %d bytes to data", data.len);
+				}
 				/** Send packets arrived signal to the send_packets thread */
-				pthread_mutex_lock(&mutex);
-				pthread_cond_signal(&cond);
-				pthread_mutex_unlock(&mutex);
+				if (queue.size >= 1)
+					wake_sender(0);
 			}
+			free(line);
+			line = 0;
+			line_len = 0;
 		}
-		free(line);
-		line = 0;
-		line_len = 0;
 	}
 
 	/** If consecutive enters are read, send termination packet */
-	log_print(LOG, "Starting termination");
-	struct packet_data term;
-	term.terminate_conn = 1;
+	log_print(INFO, "Starting termination");
+	struct packet_data term = { .terminate_conn = 1 };
 	free_queue(&queue); /** Flush remaining elements */
 	add_packet(&queue, &term);
 
 	/** Send a signal if sending thread is waiting */
-	pthread_mutex_lock(&mutex);
-	pthread_cond_signal(&cond);
-	pthread_mutex_unlock(&mutex);
+	wake_sender(0);
 
 	pthread_exit(EXIT_SUCCESS);
 }
 
+/**
+ * @brief Prints the counters of the connection as JSON, called by the stats thread on SIGUSR1
+ * 
+ * @param out 
+ */
+void dump_stats(FILE *out)
+{
+	fprintf(out, "{\"connections\":[");
+	print_stats(out, 0, &queue, &recv_stats);
+	fprintf(out, "]}");
+}
+
+/**
+ * @brief Handles a datagram received by the main thread. ACKs are added to the given batch.
+ * 
+ * @param packet 
+ * @param bytes 
+ * @param server_addr 
+ * @param server_addr_len 
+ * @param ack_tx 
+ */
+void handle_packet(struct packet_data *packet, size_t bytes,
+		   struct sockaddr *server_addr, socklen_t server_addr_len,
+		   struct io_batch *ack_tx)
+{
+	/** Drop the packet if the datagram is shorter than its header and payload, io_recv sets the length of invalid ones to 0 */
+	if (bytes < WIRE_HEADER_SIZE || wire_size(packet) > bytes) {
+		log_print(INFO, "Malformed packet, ignoring");
+		return;
+	}
+	stat_add(recv_stats.packets, 1);
+	stat_add(recv_stats.bytes, bytes);
+
+	/** Mark the connection as established with the response from server.
+	 * The response carries the segment size to use and the receive window of the server,
+	 * wake up the input thread waiting for it. */
+	if (packet->init_conn && !connection_exists) {
+		unsigned short size, window;
+		get_handshake(packet, &size, &window);
+		if (size && size < seg_size)
+			seg_size = size;
+
+		pthread_mutex_lock(&mutex);
+		pthread_mutex_lock(&queue.mutex);
+		if (window)
+			queue.peer_window = window;
+		pthread_mutex_unlock(&queue.mutex);
+		log_print(INFO,
+			  "Connection established with server, segment size %d, window %u",
+			  seg_size, queue.peer_window);
+		connection_exists = 1;
+		pthread_cond_broadcast(&established_cond);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	/** Ack function (acknowledge_packet) explanation in conn.c */
+	if (packet->is_ack) {
+		log_print(TRACE, "Received ACK for packet %d", packet->seq_num);
+		/** If termination packet got an ack, end the program */
+		if (packet->terminate_conn) {
+			/** Connection is closed, can safely exit now */
+			log_print(INFO, "Connection closed, exiting");
+			log_pool_stats();
+			io_flush(sockfd, ack_tx);
+			exit(0);
+		}
+		int res = acknowledge_packet(&queue, packet->seq_num - 1,
+					     get_ack_window(packet));
+		/** Selective Repeat acks also name the packet they acknowledge */
+		unsigned int sack = get_sack_seq(packet);
+		if (sack && selective_ack_packet(&queue, sack) != -1)
+			res = sack;
+		if (res != -1) {
+			/** Signal the next batch of packets in the queue to be sent, acks before the sender wakes up are coalesced */
+			wakeup_signal(&sender_wakeup);
+		}
+		/** Since we just got an ack, return */
+		return;
+	}
+
+	/** If the packet is not an ack and has the expected sequence number, print it.
+	 * In Selective Repeat mode, the buffered packets following it are printed too,
+	 * and the packets ahead of the expected one are buffered.
+	 */
+	char terminated = 0;
+	int buffered = 0;
+	int delivered = 0;
+	if (exp_seq_num == packet->seq_num) {
+		struct packet_data *next = packet;
+		do {
+			if (!next->init_conn)
+				write_output(output_buffer, next->char_seq,
+					     next->len);
+			terminated |= next->terminate_conn;
+			exp_seq_num++;
+			delivered++;
+		} while ((next = reorder_take(&reorder, exp_seq_num)));
+	} else if (options.mode == SELECTIVE_REPEAT) {
+		buffered = reorder_store(&reorder, exp_seq_num, packet);
+	}
+	/** A terminate packet that is delivered before is acked again */
+	if (packet->terminate_conn && exp_seq_num > packet->seq_num)
+		terminated = 1;
+
+	/** Out of order packets are dropped in Go-Back-N mode, but still acked */
+	if (exp_seq_num < packet->seq_num && !buffered) {
+		log_print(DEBUG, "Expected seq_num %d, got %d", exp_seq_num,
+			  packet->seq_num);
+		stat_add(recv_stats.out_of_order, 1);
+	} else if (buffered) {
+		stat_add(recv_stats.buffered, 1);
+	}
+
+	/** Send cumulative ack for the packet. Out of order packets are acked too,
+	 * the duplicate cumulative acks make the sender retransmit the missing packet early. */
+	struct packet_data ack;
+	ack.is_ack = 1;
+	ack.seq_num = exp_seq_num; /** Cumulative ack */
+	ack.init_conn = packet->init_conn;
+	ack.terminate_conn = terminated;
+	ack.len = 0;
+	/** The ack tells the room left for the server's packets, a buffered packet is selectively acked */
+	if (!ack.init_conn)
+		set_ack_payload(&ack, buffered ? packet->seq_num : 0,
+				receive_window(output_buffer, seg_size));
+	/** Enter the termination sequence */
+	if (terminated)
+		terminate = 1;
+	/** Only a packet delivered in order on its own and without a gap after it may wait for the next one */
+	if (!delay_ack(&delayed, &ack,
+		       delivered == 1 && !reorder.count && !ack.init_conn &&
+			       !terminated))
+		return;
+	/** ACKs of this batch are sent together after the batch is handled */
+	if (io_send(sockfd, ack_tx, &ack, server_addr, server_addr_len) ==
+	    -1)
+		log_print(ERROR, "Cannot send packet");
+	log_print(TRACE, "Sent ACK for packet %d", ack.seq_num);
+}
+
 int main(int argc, char *argv[])
 {
 	/** Get arguments */
 	char *server_ip = 0;
 	char *server_port = 0;
-	if (argc != 3) {
+	int arg = parse_options(argc, argv);
+	if (arg == -1 || argc - arg != 2) {
 		log_print(
 			ERROR,
-			"Wrong argument count.\nUsage: <server-ip> <server-port>");
+			"Wrong arguments.\nUsage: [options] <server-ip> <server-port>\n" OPTIONS_HELP);
 	} else {
-		server_ip = argv[1];
-		server_port = argv[2];
+		server_ip = argv[arg];
+		server_port = argv[arg + 1];
+	}
+
+	/** Print the counters on SIGUSR1, before the other threads are created so they do not take the signal */
+	start_stats_thread(dump_stats);
+	/** Start the log writer, packets are logged from the hot path */
+	log_init(options.log_level);
+
+	if (options.file && map_file(options.file, &input) == -1)
+		log_print(ERROR, "Cannot map %s", options.file);
+	if (options.output && open_output(options.output) == -1)
+		log_print(ERROR, "Cannot open %s", options.output);
+	if (!claim_output()) {
+		output_buffer = &delivery;
+		init_delivery(output_buffer);
+		attach_delivery(output_buffer);
 	}
 
 	/** Socket init-configuration start */
@@ -211,17 +396,21 @@ int main(int argc, char *argv[])
 	if ((sockfd = socket(res->ai_family, res->ai_socktype,
 			     res->ai_protocol)) == -1)
 		log_print(ERROR, "Cannot initialize socket");
-	log_print(LOG, "Socket at %s:%s initialized", server_ip, server_port);
+	log_print(INFO, "Socket at %s:%s initialized", server_ip, server_port);
 
 	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) ==
 	    -1)
 		log_print(ERROR, "Cannot configure socket");
-	log_print(LOG, "Socket configured");
+	/** The socket carries one connection, so a fixed pacing rate is given to the kernel too */
+	if (options.pacing > 0 &&
+	    io_pacing(sockfd, (uint64_t)options.pacing * 125000) == -1)
+		log_print(INFO, "Kernel pacing is not available");
+	log_print(INFO, "Socket configured");
 
 	/** Socket init-configuration end */
 
 	/** Initialize the queue */
-	pthread_mutex_init(&queue.mutex, NULL);
+	init_queue(&queue);
 
 	/** Initialization packet. This packet is added to the queue */
 	struct packet_data init;
@@ -229,6 +418,11 @@ int main(int argc, char *argv[])
 	init.is_ack = 0;
 	init.seq_num = 0;
 	init.terminate_conn = 0;
+	/** Propose the largest segment size that we accept and the path allows, and tell our receive window */
+	seg_size = path_segment_size(res->ai_addr, res->ai_addrlen);
+	if (seg_size > options.segment_size)
+		seg_size = options.segment_size;
+	set_handshake(&init, seg_size, options.window);
 	add_packet(&queue, &init);
 
 	/** Create the input and send threads, main thread will listen for packets */
@@ -241,97 +435,60 @@ int main(int argc, char *argv[])
 		log_print(ERROR, "Cannot create thread, error no %s",
 			  strerror(err));
 
-	unsigned int exp_seq_num = 1;
-	struct packet_data packet;
+	/** Received datagrams and the ACKs for them are batched */
+	struct io_batch rx, ack_tx;
+	io_batch_init(&rx, options.batch_size);
+	io_batch_init(&ack_tx, options.batch_size);
+	/** Socket timeout, set while an ack is held back */
+	uint64_t timeout = 0;
 	/** Run until termination */
 	while (1) {
-		struct sockaddr_storage server_addr;
-		socklen_t server_addr_len = sizeof(server_addr);
-
 		/** If in termination sequence, set the socket timeout to 1s.
 		 * Wait for 1s for packets and if no packets arrive, terminate.
+		 * Otherwise wake up for a held back ack. The timeout is only changed when an ack starts or stops
+		 * being held back, so the ack waits at most twice the ack delay.
 		 */
-		if (terminate) {
-			struct timeval tv;
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
-				       sizeof(tv)) == -1)
-				log_print(ERROR, "Cannot set timeout");
-		}
-
-		/** Wait for packets */
-		int bytes_transmitted = 0;
-		if ((bytes_transmitted = recvfrom(
-			     sockfd, &packet, sizeof(struct packet_data), 0,
-			     (struct sockaddr *)&server_addr,
-			     &server_addr_len)) == -1 &&
-		    !terminate) {
+		uint64_t wait = 0;
+		if (terminate)
+			wait = 1000000;
+		else if (delayed.pending)
+			wait = options.ack_delay + 1;
+		if (wait != timeout && io_timeout(sockfd, wait) == -1)
+			log_print(ERROR, "Cannot set timeout");
+		timeout = wait;
+
+		/** Wait for packets, drain up to a batch of them at once */
+		if (io_recv(sockfd, &rx) == -1 && !terminate &&
+		    errno != EAGAIN) {
 			log_print(ERROR, "Cannot read from socket");
-		} else if (bytes_transmitted == -1) {
+		} else if (rx.count == -1 && terminate) {
 			/** No packets arrived since the last 1s, assuming the ack is arrived to server. */
-			log_print(LOG, "No packets since the last 1s, exiting");
+			log_print(INFO, "No packets since the last 1s, exiting");
+			log_pool_stats();
 			exit(0);
 		}
 
-		log_print(LOG, "%d bytes received", bytes_transmitted);
-
-		/** Mark the connection as established with the response from server. */
-		if (packet.init_conn) {
-			log_print(LOG, "Connection established with server");
-			connection_exists = 1;
-		}
-
-		/** Ack function (acknowledge_packet) explanation in conn.c */
-		if (packet.is_ack) {
-			log_print(LOG, "Received ACK for packet %d",
-				  packet.seq_num);
-			/** If termination packet got an ack, end the program */
-			if (packet.terminate_conn) {
-				/** Connection is closed, can safely exit now */
-				log_print(LOG, "Connection closed, exiting");
-				exit(0);
-			}
-			int res = acknowledge_packet(&queue, packet.seq_num - 1,
-						     &mutex);
-			if (res != -1) {
-				/** Signal the next batch of packets in the queue to be sent */
-				pthread_mutex_lock(&timeout_mutex);
-				pthread_cond_signal(&timeout_cond);
-				pthread_mutex_unlock(&timeout_mutex);
-			}
-			/** Since we just got an ack, continue*/
-			continue;
+		for (int r = 0; r < rx.count; r++) {
+			log_print(TRACE, "%d bytes received", rx.msgs[r].msg_len);
+			handle_packet(&rx.packets[r], rx.msgs[r].msg_len,
+				      (struct sockaddr *)&rx.addrs[r],
+				      rx.msgs[r].msg_hdr.msg_namelen, &ack_tx);
 		}
 
-		/** If the packet is not an ack and has the expected sequence number, print it */
-		if (exp_seq_num == packet.seq_num) {
-			if (!packet.init_conn)
-				printf("%s", packet.char_seq);
-			exp_seq_num++;
-		}
-
-		/** Send cumulative ack for the packet */
-		if (exp_seq_num >= packet.seq_num) {
-			struct packet_data ack;
-			ack.is_ack = 1;
-			ack.seq_num = exp_seq_num; /** Cumulative ack */
-			ack.init_conn = packet.init_conn;
-			ack.terminate_conn = packet.terminate_conn;
-			/** Enter the termination sequence */
-			if (packet.terminate_conn)
-				terminate = 1;
-			int ack_bytes = 0;
-			if ((ack_bytes = sendto(sockfd, &ack,
-						sizeof(struct packet_data), 0,
-						(struct sockaddr *)&server_addr,
-						server_addr_len)) == -1)
+		/** Send the held back ack if its deadline passed, with the window of now */
+		struct packet_data ack;
+		if (expired_ack(&delayed, now_us(), &ack)) {
+			set_ack_payload(&ack, 0,
+					receive_window(output_buffer,
+						       seg_size));
+			if (io_send(sockfd, &ack_tx, &ack, res->ai_addr,
+				    res->ai_addrlen) == -1)
 				log_print(ERROR, "Cannot send packet");
-			log_print(LOG, "Sent ACK for packet %d", ack.seq_num);
-		} else {
-			log_print(LOG, "Expected seq_num %d, got %d",
-				  exp_seq_num, packet.seq_num);
 		}
+
+		/** Send the ACKs of the batch with one call */
+		if (io_flush(sockfd, &ack_tx) == -1)
+			log_print(ERROR, "Cannot send packet");
 	}
 
 	return EXIT_SUCCESS;
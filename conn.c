@@ -5,7 +5,484 @@
  * 
  */
 
+#include <time.h>
+
 #include "conn.h"
+#include "crc.h"
+#include "io.h"
+#include "options.h"
+
+/**
+ * @brief Returns the monotonic clock in microseconds
+ * 
+ * @return uint64_t 
+ */
+uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Initializes the given estimator with INITIAL_RTO and the given bounds
+ * 
+ * @param rtt 
+ * @param min_rto 
+ * @param max_rto 
+ */
+void init_rtt(struct rtt_estimator *rtt, uint64_t min_rto, uint64_t max_rto)
+{
+	rtt->srtt = rtt->rttvar = 0;
+	rtt->min_rto = min_rto;
+	rtt->max_rto = max_rto;
+	rtt->rto = INITIAL_RTO;
+	if (rtt->rto < min_rto)
+		rtt->rto = min_rto;
+	if (rtt->rto > max_rto)
+		rtt->rto = max_rto;
+}
+
+/**
+ * @brief Updates the smoothed round trip time and its variation with the given sample, and recomputes the timeout.
+ * 
+ * @param rtt 
+ * @param sample 
+ */
+void rtt_sample(struct rtt_estimator *rtt, uint64_t sample)
+{
+	if (!rtt->srtt) {
+		rtt->srtt = sample ? sample : 1;
+		rtt->rttvar = sample / 2;
+	} else {
+		uint64_t diff = rtt->srtt > sample ? rtt->srtt - sample :
+						     sample - rtt->srtt;
+		/** RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R */
+		rtt->rttvar = (3 * rtt->rttvar + diff) / 4;
+		rtt->srtt = (7 * rtt->srtt + sample) / 8;
+	}
+
+	/** RTO = SRTT + 4 RTTVAR, the clock granularity is covered by the lower bound */
+	rtt->rto = rtt->srtt + 4 * rtt->rttvar;
+	if (rtt->rto < rtt->min_rto)
+		rtt->rto = rtt->min_rto;
+	if (rtt->rto > rtt->max_rto)
+		rtt->rto = rtt->max_rto;
+}
+
+/**
+ * @brief Doubles the timeout of the given estimator after a retransmission timeout
+ * 
+ * @param rtt 
+ */
+void rtt_backoff(struct rtt_estimator *rtt)
+{
+	rtt->rto *= 2;
+	if (rtt->rto > rtt->max_rto)
+		rtt->rto = rtt->max_rto;
+}
+
+/**
+ * @brief Samples the round trip time of the given packet when it is acked, if it is sent only once.
+ * A packet that is waiting to be sent again after a go back is not sampled either.
+ * 
+ * @param queue 
+ * @param packet 
+ */
+static void sample_ack(struct packet_queue *queue, struct packet_t *packet)
+{
+	if (packet->transmissions == 1 && packet->sent_at) {
+		uint64_t sample = now_us() - packet->sent_at;
+		rtt_sample(&queue->rtt, sample);
+		stat_rtt(&queue->stats, sample);
+	}
+}
+
+/**
+ * @brief Counts an ack of the packet before the first one of the queue as a duplicate. Returns 1 if it triggers a fast retransmit.
+ * 
+ * @details Receivers ack every out of order packet with the sequence number they expect,
+ * so DUP_ACK_THRESHOLD duplicates mean that the first packet is most likely lost.
+ * An ack that advertises a zero or a changed receive window is a window update or the answer to a probe instead, as in RFC 5681.
+ * The congestion control reacts to one loss per window, see recover.
+ * Queue lock must be held.
+ * 
+ * @param queue 
+ * @param seq_num 
+ * @param window 
+ * @return int 
+ */
+static int duplicate_ack(struct packet_queue *queue, int seq_num, int window)
+{
+	struct packet_t *first = queue_first(queue);
+	if (!first || !first->sent_at || first->data.seq_num != seq_num + 1)
+		return 0;
+	if (!window || (window != -1 && window != queue->peer_window))
+		return 0;
+
+	stat_add(queue->stats.dup_acks, 1);
+	if (++queue->dup_acks < DUP_ACK_THRESHOLD)
+		return 0;
+
+	queue->fast_retransmit = 1;
+	if (first->data.seq_num > queue->recover) {
+		queue->recover = queue->last_sent;
+		queue->cc.ops->on_loss(&queue->cc);
+	}
+	return 1;
+}
+
+/**
+ * @brief Takes the receive window advertised by the ack of the given sequence number. Returns 1 if the window opened or grew.
+ * 
+ * @details Only the acks of the packet before the first one of the queue are current, the acked packets must be evicted already.
+ * An older ack arrived out of order and would shrink the window back, so its window is dropped. A window of -1 is not advertised.
+ * Queue lock must be held.
+ * 
+ * @param queue 
+ * @param seq_num 
+ * @param window 
+ * @return int 
+ */
+static int update_peer_window(struct packet_queue *queue, int seq_num,
+			      int window)
+{
+	struct packet_t *first = queue_first(queue);
+	unsigned int next = first ? first->data.seq_num : queue->last_sent + 1;
+	if (window == -1 || (unsigned int)seq_num + 1 != next)
+		return 0;
+
+	int grew = window > queue->peer_window;
+	queue->peer_window = window;
+	return grew;
+}
+
+/**
+ * @brief Discounts the duplicate acks that can still arrive for the packets sent before the first one is resent.
+ * Every packet sent after the first one causes at most one duplicate, the ones already counted are not expected again.
+ * 
+ * @param queue 
+ * @param first 
+ */
+static void expect_stale_acks(struct packet_queue *queue,
+			      struct packet_t *first)
+{
+	int outstanding = queue->last_sent > first->data.seq_num ?
+				  queue->last_sent - first->data.seq_num :
+				  0;
+	int seen = queue->dup_acks > 0 ? queue->dup_acks : 0;
+	queue->dup_acks = seen < outstanding ? seen - outstanding : 0;
+}
+
+/**
+ * @brief Returns the number of bytes of the given packet that are stored, the header fields and the payload
+ * 
+ * @param packet 
+ * @return size_t 
+ */
+size_t packet_size(struct packet_data *packet)
+{
+	return PACKET_HEADER_SIZE + packet->len;
+}
+
+/**
+ * @brief Returns the number of bytes of the given packet that are sent, the wire header and the payload
+ * 
+ * @param packet 
+ * @return size_t 
+ */
+size_t wire_size(struct packet_data *packet)
+{
+	return WIRE_HEADER_SIZE + packet->len;
+}
+
+/**
+ * @brief Returns 1 if the given packet is sent with a checksum. A payload without room for the trailer in the packet buffer is sent without one,
+ * which the segment size negotiation prevents.
+ * 
+ * @param packet 
+ * @return int 
+ */
+int has_checksum(struct packet_data *packet)
+{
+	return options.checksum &&
+	       packet->len <= MAX_PAYLOAD_SIZE - CHECKSUM_SIZE;
+}
+
+/**
+ * @brief Writes the wire header of the given packet to the given WIRE_HEADER_SIZE bytes
+ * 
+ * @param packet 
+ * @param wire 
+ */
+void encode_header(struct packet_data *packet, unsigned char *wire)
+{
+	uint16_t net_len = htons(packet->len);
+	uint32_t net_seq = htonl(packet->seq_num);
+
+	wire[0] = WIRE_VERSION;
+	wire[1] = (packet->is_ack ? WIRE_ACK : 0) |
+		  (packet->init_conn ? WIRE_INIT : 0) |
+		  (packet->terminate_conn ? WIRE_TERMINATE : 0) |
+		  (has_checksum(packet) ? WIRE_CHECKSUM : 0);
+	memcpy(wire + 2, &net_len, sizeof(net_len));
+	memcpy(wire + 4, &net_seq, sizeof(net_seq));
+}
+
+/**
+ * @brief Writes the checksum of the given encoded header and payload to the given trailer
+ * 
+ * @param wire 
+ * @param payload 
+ * @param len 
+ * @param trailer 
+ */
+void seal_packet(const unsigned char *wire, const char *payload, size_t len,
+		 unsigned char *trailer)
+{
+	uint32_t net_crc =
+		htonl(crc32c(crc32c(0, wire, WIRE_HEADER_SIZE), payload, len));
+	memcpy(trailer, &net_crc, sizeof(net_crc));
+}
+
+/**
+ * @brief Reads the wire header of a received datagram of the given length into the header fields of the given packet.
+ * Returns -1 if the datagram is not a valid packet or its checksum does not match.
+ * 
+ * @details The payload follows the header in the buffer. The header may overlap the fields of the packet,
+ * it is read completely before they are written.
+ * 
+ * @param wire 
+ * @param bytes 
+ * @param packet 
+ * @return int 
+ */
+int decode_header(const unsigned char *wire, size_t bytes,
+		  struct packet_data *packet)
+{
+	if (bytes < WIRE_HEADER_SIZE || wire[0] != WIRE_VERSION)
+		return -1;
+
+	unsigned char flags = wire[1];
+	uint16_t net_len;
+	uint32_t net_seq;
+	memcpy(&net_len, wire + 2, sizeof(net_len));
+	memcpy(&net_seq, wire + 4, sizeof(net_seq));
+	size_t len = ntohs(net_len);
+	size_t trailer = flags & WIRE_CHECKSUM ? CHECKSUM_SIZE : 0;
+	if (len > MAX_PAYLOAD_SIZE || WIRE_HEADER_SIZE + len + trailer > bytes)
+		return -1;
+
+	/** A corrupted packet is dropped here, before its sequence number is looked at */
+	if (trailer) {
+		uint32_t net_crc;
+		memcpy(&net_crc, wire + WIRE_HEADER_SIZE + len, sizeof(net_crc));
+		if (crc32c(0, wire, WIRE_HEADER_SIZE + len) != ntohl(net_crc))
+			return -1;
+	}
+
+	packet->is_ack = (flags & WIRE_ACK) != 0;
+	packet->init_conn = (flags & WIRE_INIT) != 0;
+	packet->terminate_conn = (flags & WIRE_TERMINATE) != 0;
+	packet->len = len;
+	packet->seq_num = ntohl(net_seq);
+	return 0;
+}
+
+/**
+ * @brief Puts the given segment size and receive window to the payload of an init packet or its ack
+ * 
+ * @param packet 
+ * @param seg_size 
+ * @param window 
+ */
+void set_handshake(struct packet_data *packet, unsigned short seg_size,
+		   unsigned short window)
+{
+	uint16_t net_fields[2] = { htons(seg_size), htons(window) };
+	memcpy(packet->char_seq, net_fields, sizeof(net_fields));
+	packet->len = sizeof(net_fields);
+}
+
+/**
+ * @brief Reads the segment size and receive window in the payload of an init packet or its ack, 0 for the missing ones
+ * 
+ * @param packet 
+ * @param seg_size 
+ * @param window 
+ */
+void get_handshake(struct packet_data *packet, unsigned short *seg_size,
+		   unsigned short *window)
+{
+	uint16_t net_fields[2] = { 0, 0 };
+	memcpy(net_fields, packet->char_seq,
+	       packet->len < sizeof(net_fields) ? packet->len :
+						  sizeof(net_fields));
+	*seg_size = packet->len >= sizeof(uint16_t) ? ntohs(net_fields[0]) : 0;
+	*window = packet->len >= sizeof(net_fields) ? ntohs(net_fields[1]) : 0;
+}
+
+/**
+ * @brief Puts the sequence number of the packet that the given ack selectively acknowledges, 0 if none,
+ * and the receive window in packets to its payload
+ * 
+ * @param ack 
+ * @param sack_seq 
+ * @param window 
+ */
+void set_ack_payload(struct packet_data *ack, unsigned int sack_seq,
+		     unsigned short window)
+{
+	uint32_t net_seq = htonl(sack_seq);
+	uint16_t net_window = htons(window);
+	memcpy(ack->char_seq, &net_seq, sizeof(net_seq));
+	memcpy(ack->char_seq + sizeof(net_seq), &net_window, sizeof(net_window));
+	ack->len = ACK_PAYLOAD_SIZE;
+}
+
+/**
+ * @brief Returns the sequence number that the given ack selectively acknowledges, 0 if it is only cumulative
+ * 
+ * @param ack 
+ * @return unsigned int 
+ */
+unsigned int get_sack_seq(struct packet_data *ack)
+{
+	uint32_t net_seq;
+	if (ack->init_conn || ack->len != ACK_PAYLOAD_SIZE)
+		return 0;
+
+	memcpy(&net_seq, ack->char_seq, sizeof(net_seq));
+	return ntohl(net_seq);
+}
+
+/**
+ * @brief Returns the receive window advertised by the given ack, or -1 if it does not carry one
+ * 
+ * @param ack 
+ * @return int 
+ */
+int get_ack_window(struct packet_data *ack)
+{
+	uint16_t net_window;
+	if (ack->init_conn || ack->len != ACK_PAYLOAD_SIZE)
+		return -1;
+
+	memcpy(&net_window, ack->char_seq + sizeof(uint32_t), sizeof(net_window));
+	return ntohs(net_window);
+}
+
+#ifdef QUEUE_LIST
+
+/**
+ * @brief Allocates a new slab of packet nodes and puts them to the free nodes of the queue.
+ * 
+ * @param queue 
+ */
+static void grow_pool(struct packet_queue *queue)
+{
+	struct pool_slab *slab = malloc(sizeof(struct pool_slab) +
+					queue->slab_size *
+						sizeof(struct packet_t));
+	slab->next = queue->slabs;
+	queue->slabs = slab;
+
+	for (unsigned int i = 0; i < queue->slab_size; i++) {
+		slab->nodes[i].next = queue->free_nodes;
+		queue->free_nodes = &slab->nodes[i];
+	}
+}
+
+/**
+ * @brief Takes a node from the pool of the queue. Queue lock must be held.
+ * 
+ * @param queue 
+ * @return struct packet_t* 
+ */
+static struct packet_t *pool_get(struct packet_queue *queue)
+{
+	if (queue->free_nodes) {
+		queue->pool.hits++;
+	} else {
+		queue->pool.misses++;
+		grow_pool(queue);
+	}
+
+	struct packet_t *node = queue->free_nodes;
+	queue->free_nodes = node->next;
+	return node;
+}
+
+/**
+ * @brief Returns the given node to the pool of the queue. Queue lock must be held.
+ * 
+ * @param queue 
+ * @param node 
+ */
+static void pool_put(struct packet_queue *queue, struct packet_t *node)
+{
+	node->next = queue->free_nodes;
+	queue->free_nodes = node;
+}
+
+#endif // QUEUE_LIST
+
+/**
+ * @brief Returns the number of packets a queue preallocates, QUEUE_WINDOWS receive windows bounded by its send buffer.
+ * 
+ * @param limit Packets the send buffer holds
+ * @return unsigned int 
+ */
+static unsigned int preallocated_packets(int limit)
+{
+	unsigned int count = QUEUE_WINDOWS * options.window;
+	return count < (unsigned int)limit ? count : (unsigned int)limit;
+}
+
+/**
+ * @brief Initializes the given queue. Storage for the packets of QUEUE_WINDOWS receive windows is preallocated.
+ * 
+ * @param queue 
+ */
+void init_queue(struct packet_queue *queue)
+{
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->drained, NULL);
+	queue->size = 0;
+	queue->last_sent = 0;
+	memset(&queue->pool, 0, sizeof(queue->pool));
+	memset(&queue->stats, 0, sizeof(queue->stats));
+	init_rtt(&queue->rtt, options.min_rto, options.max_rto);
+	init_congestion(&queue->cc, options.cc);
+	queue->peer_window = WINDOW_SIZE;
+	queue->probe_at = queue->probe_interval = 0;
+	queue->dup_acks = queue->recover = 0;
+	queue->fast_retransmit = 0;
+	/** The bucket starts full, the first refill is capped at its depth */
+	memset(&queue->pacer, 0, sizeof(queue->pacer));
+	/** The send buffer is counted in packet slots, which have room for a full payload whatever the packet carries,
+	 * so the memory of the queue stays bounded with short lines too */
+	queue->limit = options.send_buffer / sizeof(struct packet_t);
+	if (queue->limit < 1)
+		queue->limit = 1;
+#ifdef QUEUE_LIST
+	queue->head = queue->tail = NULL;
+	queue->free_nodes = NULL;
+	queue->slabs = NULL;
+	queue->slab_size = preallocated_packets(queue->limit);
+	grow_pool(queue);
+#else
+	/** The slot of a packet is masked out of its sequence number, so the ring is a power of two */
+	queue->capacity = 1;
+	while (queue->capacity < preallocated_packets(queue->limit))
+		queue->capacity <<= 1;
+	queue->ring = calloc(queue->capacity, sizeof(struct packet_t));
+	queue->head_seq = 1;
+#endif
+}
+
+#ifdef QUEUE_LIST
 
 /**
  * @brief Finds and returns the packet with the given seq_num in the given queue. If not found, returns NULL.
@@ -26,22 +503,55 @@ struct packet_t *find_packet(struct packet_queue *queue, int seq_num)
 	return packet;
 }
 
+/**
+ * @brief Returns the first packet of the given queue, NULL if the queue is empty.
+ * 
+ * @param queue 
+ * @return struct packet_t* 
+ */
+struct packet_t *queue_first(struct packet_queue *queue)
+{
+	return queue->head;
+}
+
+/**
+ * @brief Returns the packet after the given packet, NULL if it is the last one.
+ * 
+ * @param queue 
+ * @param packet 
+ * @return struct packet_t* 
+ */
+struct packet_t *queue_next(struct packet_queue *queue,
+			    struct packet_t *packet)
+{
+	return packet->next;
+}
+
 /**
  * @brief Adds and returns the given packet data to the given queue. Sequence number is filled from this function.
+ * If payload is given, only the header is copied and the packet is sent with the payload.
  * 
  * @param queue 
  * @param data 
+ * @param payload 
  * @return struct packet_t* 
  */
-struct packet_t *add_packet(struct packet_queue *queue,
-			    struct packet_data *data)
+static struct packet_t *append_packet(struct packet_queue *queue,
+				      struct packet_data *data,
+				      const char *payload)
 {
 	/** Get a lock to prevent data race with input thread */
 	pthread_mutex_lock(&queue->mutex);
-	struct packet_t *new_elem = calloc(1, sizeof(struct packet_t));
-	new_elem->data = *data;
+	struct packet_t *new_elem = pool_get(queue);
+	memcpy(&new_elem->data, data,
+	       payload ? PACKET_HEADER_SIZE : packet_size(data));
+	new_elem->payload = payload;
+	new_elem->sent_at = 0;
+	new_elem->transmissions = 0;
+	new_elem->acked = 0;
 	new_elem->next = new_elem->prev = NULL;
-	queue->size++;
+	if (++queue->size > queue->pool.high_water)
+		queue->pool.high_water = queue->size;
 
 	if (!queue->head) {
 		new_elem->data.seq_num = queue->last_sent + 1;
@@ -65,49 +575,57 @@ struct packet_t *add_packet(struct packet_queue *queue,
  * 
  * @details In this implementation, eviction means ack, as it will not be sent again.
  * This function also ignores the duplicate acks from older packets implicitly as all such will be evicted.
+ * Acks of the packet just before the queue are counted by duplicate_ack, the sequence number is also returned
+ * when they trigger a fast retransmit, so that the sender is signaled.
+ * The receive window advertised by a current ack replaces the peer window, -1 if the ack does not carry one.
+ * An ack that only opens the window returns the sequence number too.
  * Window sliding happens through poping all acked from the queue.
  * 
  * @param queue 
  * @param seq_num 
- * @param mutex 
+ * @param window 
  * @return int 
  */
-int acknowledge_packet(struct packet_queue *queue, int seq_num,
-		       pthread_mutex_t *mutex)
+int acknowledge_packet(struct packet_queue *queue, int seq_num, int window)
 {
 	struct packet_t *packet;
-	/** Get the lock to prevent the synchronization issues with sending thread */
-	pthread_mutex_lock(mutex);
-	/** Get another lock to prevent data race with the input thread */
+	/** The queue lock guards the window against the sender and the input thread */
 	pthread_mutex_lock(&queue->mutex);
 	/** Find the packet with given sequence number
 	 * Iterate through all packets before the packet and evict them as they are acknowledged */
 	if ((packet = find_packet(queue, seq_num))) {
+		sample_ack(queue, packet);
 		queue->head = packet->next;
-		if (packet->next) {
+		if (queue->head)
 			queue->head->prev = NULL;
+		else
+			queue->tail = NULL;
 
-			struct packet_t *temp;
-			while (packet) {
-				queue->size--;
-				temp = packet;
-				packet = packet->prev;
-				free(temp);
-			}
-		} else {
-			free(packet);
-			queue->tail = queue->head;
-			queue->size = 0;
+		/** Return the evicted packets to the pool */
+		struct packet_t *temp;
+		unsigned int evicted = 0;
+		while (packet) {
+			queue->size--;
+			evicted++;
+			temp = packet;
+			packet = packet->prev;
+			pool_put(queue, temp);
 		}
+		queue->cc.ops->on_ack(&queue->cc, evicted);
+		queue->dup_acks = 0;
+		pthread_cond_broadcast(&queue->drained);
+		update_peer_window(queue, seq_num, window);
 
 		pthread_mutex_unlock(&queue->mutex);
-		pthread_mutex_unlock(mutex);
 		return seq_num;
 	}
 
+	/** A duplicate ack may make the first packet due again, and a window update lets more packets out */
+	int res = duplicate_ack(queue, seq_num, window) ? seq_num : -1;
+	if (update_peer_window(queue, seq_num, window))
+		res = seq_num;
 	pthread_mutex_unlock(&queue->mutex);
-	pthread_mutex_unlock(mutex);
-	return -1;
+	return res;
 }
 
 /**
@@ -124,78 +642,933 @@ void free_queue(struct packet_queue *queue)
 	while (last) {
 		temp = last;
 		last = last->prev;
-		free(temp);
+		pool_put(queue, temp);
 	}
 
 	queue->size = 0;
 	queue->head = queue->tail = NULL;
+	pthread_cond_broadcast(&queue->drained);
 	pthread_mutex_unlock(&queue->mutex);
 }
 
 /**
- * @brief Finds and returns the connection with the given id in the given queue. If not found, returns NULL.
+ * @brief Frees the given queue and the resources owned by it
  * 
- * @param list 
- * @param addr 
- * @return struct connection_t* 
+ * @param queue 
  */
-struct connection_t *find_connection(struct connection_t *list,
-				     struct sockaddr *addr)
+void destroy_queue(struct packet_queue *queue)
 {
-	while (list) {
-		if (!strcmp(list->target_addr.sa_data, addr->sa_data))
-			break;
-		list = list->next;
-	}
+	free_queue(queue);
 
-	return list;
+	struct pool_slab *slab;
+	while ((slab = queue->slabs)) {
+		queue->slabs = slab->next;
+		free(slab);
+	}
+	queue->free_nodes = NULL;
+	pthread_mutex_destroy(&queue->mutex);
 }
 
+#else
+
 /**
- * @brief Adds and returns a new connection to the given list.
+ * @brief Finds and returns the packet with the given seq_num in the given queue. If not found, returns NULL.
  * 
- * @param list 
- * @param addr 
- * @param addr_len 
- * @return struct connection_t* 
+ * @details The slot of a packet is seq_num % capacity, so only the range of the queue needs to be checked.
+ * 
+ * @param queue 
+ * @param seq_num 
+ * @return struct packet_t* 
  */
-struct connection_t *add_connection(struct connection_t *list,
-				    struct sockaddr *addr, socklen_t addr_len)
+struct packet_t *find_packet(struct packet_queue *queue, int seq_num)
 {
-	struct connection_t *new_elem = calloc(1, sizeof(struct connection_t));
-	new_elem->target_addr = *addr;
-	new_elem->target_addr_len = addr_len;
-	pthread_cond_init(&new_elem->cond, NULL);
-	pthread_cond_init(&new_elem->timeout_cond, NULL);
-	pthread_mutex_init(&new_elem->timeout_mutex, NULL);
-	pthread_mutex_init(&new_elem->queue.mutex, NULL);
-	new_elem->next = new_elem->prev = NULL;
-	new_elem->is_active = 1;
-
-	if (!list) {
-		new_elem->id = 0;
-		return new_elem;
-	}
+	/** Unsigned difference also rejects the sequence numbers before the head */
+	if ((unsigned int)seq_num - queue->head_seq >= queue->size)
+		return NULL;
 
-	while (list->next)
-		list = list->next;
-
-	new_elem->id = list->id + 1;
-	new_elem->prev = list;
-
-	list->next = new_elem;
-	return new_elem;
+	return &queue->ring[seq_num & (queue->capacity - 1)];
 }
 
 /**
- * @brief Deletes the given connection from the list
+ * @brief Returns the first packet of the given queue, NULL if the queue is empty.
  * 
- * @param conn 
+ * @param queue 
+ * @return struct packet_t* 
  */
-void delete_connection(struct connection_t *conn)
+struct packet_t *queue_first(struct packet_queue *queue)
 {
-	conn->prev->next = conn->next;
-	conn->next->prev = conn->prev;
+	return find_packet(queue, queue->head_seq);
+}
+
+/**
+ * @brief Returns the packet after the given packet, NULL if it is the last one.
+ * 
+ * @param queue 
+ * @param packet 
+ * @return struct packet_t* 
+ */
+struct packet_t *queue_next(struct packet_queue *queue,
+			    struct packet_t *packet)
+{
+	return find_packet(queue, packet->data.seq_num + 1);
+}
+
+/**
+ * @brief Doubles the capacity of the ring. Packets are moved to their slots in the new ring.
+ * 
+ * @param queue 
+ */
+static void grow_queue(struct packet_queue *queue)
+{
+	unsigned int capacity = queue->capacity * 2;
+	struct packet_t *ring = calloc(capacity, sizeof(struct packet_t));
+	for (unsigned int seq = queue->head_seq;
+	     seq - queue->head_seq < queue->size; seq++)
+		ring[seq & (capacity - 1)] =
+			queue->ring[seq & (queue->capacity - 1)];
+
+	free(queue->ring);
+	queue->ring = ring;
+	queue->capacity = capacity;
+}
+
+/**
+ * @brief Adds and returns the given packet data to the given queue. Sequence number is filled from this function.
+ * If payload is given, only the header is copied and the packet is sent with the payload.
+ * 
+ * @details The returned pointer is valid until the next add_packet call, since the ring may grow.
+ * 
+ * @param queue 
+ * @param data 
+ * @param payload 
+ * @return struct packet_t* 
+ */
+static struct packet_t *append_packet(struct packet_queue *queue,
+				      struct packet_data *data,
+				      const char *payload)
+{
+	/** Get a lock to prevent data race with input thread */
+	pthread_mutex_lock(&queue->mutex);
+	if (!queue->size)
+		queue->head_seq = queue->last_sent + 1;
+
+	if (queue->size == queue->capacity) {
+		queue->pool.misses++;
+		grow_queue(queue);
+	} else {
+		queue->pool.hits++;
+	}
+
+	unsigned int seq_num = queue->head_seq + queue->size;
+	struct packet_t *new_elem =
+		&queue->ring[seq_num & (queue->capacity - 1)];
+	memcpy(&new_elem->data, data,
+	       payload ? PACKET_HEADER_SIZE : packet_size(data));
+	new_elem->payload = payload;
+	new_elem->sent_at = 0;
+	new_elem->transmissions = 0;
+	new_elem->acked = 0;
+	new_elem->data.seq_num = seq_num;
+	if (++queue->size > queue->pool.high_water)
+		queue->pool.high_water = queue->size;
+	pthread_mutex_unlock(&queue->mutex);
+
+	return new_elem;
+}
+
+/**
+ * @brief Evicts the packets before the given sequence number and returns the it from the given queue. If the packet is not found, returns -1.
+ * 
+ * @details In this implementation, eviction means ack, as it will not be sent again.
+ * This function also ignores the duplicate acks from older packets implicitly as all such will be evicted.
+ * Acks of the packet just before the queue are counted by duplicate_ack, the sequence number is also returned
+ * when they trigger a fast retransmit, so that the sender is signaled.
+ * The receive window advertised by a current ack replaces the peer window, -1 if the ack does not carry one.
+ * An ack that only opens the window returns the sequence number too.
+ * Window sliding happens through moving the head of the ring past the acked packet.
+ * 
+ * @param queue 
+ * @param seq_num 
+ * @param window 
+ * @return int 
+ */
+int acknowledge_packet(struct packet_queue *queue, int seq_num, int window)
+{
+	int res = -1;
+	/** The queue lock guards the window against the sender and the input thread */
+	pthread_mutex_lock(&queue->mutex);
+	/** Evict every packet up to and including the acked one at once */
+	struct packet_t *packet = find_packet(queue, seq_num);
+	if (packet) {
+		sample_ack(queue, packet);
+		unsigned int evicted = seq_num - queue->head_seq + 1;
+		queue->head_seq += evicted;
+		queue->size -= evicted;
+		queue->cc.ops->on_ack(&queue->cc, evicted);
+		queue->dup_acks = 0;
+		pthread_cond_broadcast(&queue->drained);
+		res = seq_num;
+	} else if (duplicate_ack(queue, seq_num, window)) {
+		/** A duplicate ack made the first packet due again */
+		res = seq_num;
+	}
+	/** A window update lets more packets out */
+	if (update_peer_window(queue, seq_num, window))
+		res = seq_num;
+
+	pthread_mutex_unlock(&queue->mutex);
+	return res;
+}
+
+/**
+ * @brief Free the given queue
+ * 
+ * @details Only empties the queue, the ring storage is kept for the next packets.
+ * 
+ * @param queue 
+ */
+void free_queue(struct packet_queue *queue)
+{
+	/** Lock the queue to prevent data race */
+	pthread_mutex_lock(&queue->mutex);
+	queue->size = 0;
+	pthread_cond_broadcast(&queue->drained);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Frees the given queue and the resources owned by it
+ * 
+ * @param queue 
+ */
+void destroy_queue(struct packet_queue *queue)
+{
+	free_queue(queue);
+	free(queue->ring);
+	queue->ring = NULL;
+	queue->capacity = 0;
+	pthread_mutex_destroy(&queue->mutex);
+}
+
+#endif // QUEUE_LIST
+
+/**
+ * @brief Adds and returns the given packet data to the given queue. Sequence number is filled from this function.
+ * 
+ * @param queue 
+ * @param data 
+ * @return struct packet_t* 
+ */
+struct packet_t *add_packet(struct packet_queue *queue,
+			    struct packet_data *data)
+{
+	return append_packet(queue, data, NULL);
+}
+
+/**
+ * @brief Adds and returns a packet with the given header whose payload stays in the given mapped memory.
+ * header->len bytes of payload are sent from there, so it must stay mapped until the packet is acked.
+ * 
+ * @param queue 
+ * @param header 
+ * @param payload 
+ * @return struct packet_t* 
+ */
+struct packet_t *add_mapped_packet(struct packet_queue *queue,
+				   struct packet_data *header,
+				   const char *payload)
+{
+	return append_packet(queue, header, payload);
+}
+
+/**
+ * @brief Returns the number of packets that can be in flight, the smaller of the congestion window and the receive window of the peer.
+ * Queue lock must be held.
+ * 
+ * @param queue 
+ * @return unsigned int 
+ */
+unsigned int queue_window(struct packet_queue *queue)
+{
+	return queue->cc.cwnd < queue->peer_window ? queue->cc.cwnd :
+						     queue->peer_window;
+}
+
+/**
+ * @brief Returns 1 if a packet in the first window packets of the queue timed out.
+ * Go-Back-N only times the first packet, Selective Repeat every packet that is not selectively acked.
+ * 
+ * @param queue 
+ * @param mode 
+ * @param window 
+ * @param now 
+ * @return int 
+ */
+static int window_timed_out(struct packet_queue *queue, enum arq_mode mode,
+			    unsigned int window, uint64_t now)
+{
+	int i = 0;
+	for (struct packet_t *packet = queue_first(queue); packet && i < window;
+	     packet = queue_next(queue, packet), i++) {
+		if (!packet->acked && packet->sent_at &&
+		    now >= packet->sent_at + queue->rtt.rto)
+			return 1;
+		if (mode == GO_BACK_N)
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Marks the packet with the given sequence number as selectively acknowledged and returns its sequence number.
+ * If the packet is not found, returns -1.
+ * 
+ * @details The packet stays in the queue until a cumulative ack evicts it, it is only not sent again.
+ * 
+ * @param queue 
+ * @param seq_num 
+ * @return int 
+ */
+int selective_ack_packet(struct packet_queue *queue, int seq_num)
+{
+	int res = -1;
+	pthread_mutex_lock(&queue->mutex);
+	struct packet_t *packet = find_packet(queue, seq_num);
+	if (packet && !packet->acked) {
+		sample_ack(queue, packet);
+		packet->acked = 1;
+		res = seq_num;
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+	return res;
+}
+
+/**
+ * @brief Returns the pacing rate of the given queue in bytes per second, or 0 if it is not paced.
+ * 
+ * @details A rate given with --pace is used as is. The auto rate is the gain times the usable window per smoothed
+ * round trip time, with the window counted in packets of the given wire size. Until the first round trip time sample it is not paced.
+ * 
+ * @param queue 
+ * @param size 
+ * @return uint64_t 
+ */
+static uint64_t pacing_rate(struct packet_queue *queue, size_t size)
+{
+	if (options.pacing > 0)
+		return (uint64_t)options.pacing * 125000;
+	if (options.pacing != PACING_AUTO || !queue->rtt.srtt)
+		return 0;
+
+	unsigned int window = queue->cc.cwnd < queue->peer_window ?
+				      queue->cc.cwnd :
+				      queue->peer_window;
+	unsigned int gain = queue->cc.cwnd < queue->cc.ssthresh ?
+				    PACING_GAIN_SLOW_START :
+				    PACING_GAIN;
+	/** Percent and microseconds: * 1000000 / 100 */
+	return (uint64_t)window * size * gain * 10000 / queue->rtt.srtt;
+}
+
+/**
+ * @brief Takes a packet of the given wire size from the token bucket of the given queue.
+ * Returns 0 if it may be sent now, otherwise the monotonic time in microseconds it may be sent at.
+ * 
+ * @param queue 
+ * @param now 
+ * @param size 
+ * @return uint64_t 
+ */
+static uint64_t pace_packet(struct packet_queue *queue, uint64_t now,
+			    size_t size)
+{
+	struct pacer *pacer = &queue->pacer;
+	uint64_t rate = pacing_rate(queue, size);
+	if (!rate)
+		return 0;
+
+	/** Refill for the time since the last packet, up to the depth. Long idle times are capped so the product does not overflow. */
+	int64_t depth = rate * PACING_BURST_TIME;
+	if (depth < (int64_t)(PACING_MIN_BURST * size * 1000000))
+		depth = PACING_MIN_BURST * size * 1000000;
+	uint64_t elapsed = now - pacer->last;
+	if (elapsed > PACING_BURST_TIME * 1000)
+		elapsed = PACING_BURST_TIME * 1000;
+	pacer->tokens += elapsed * rate;
+	if (pacer->tokens > depth)
+		pacer->tokens = depth;
+	pacer->last = now;
+
+	/** The packet leaves once the debt of the previous one is paid off */
+	if (pacer->tokens < 0)
+		return now + (-pacer->tokens + rate - 1) / rate;
+
+	pacer->tokens -= size * 1000000;
+	return 0;
+}
+
+/**
+ * @brief Sends a probe when the persist timer expires, while the peer has a zero receive window and packets are queued.
+ * Returns the number of bytes sent or -1 on error.
+ * 
+ * @details The receiver only acks what it receives, so a window that opens is seen from the ack of a probe.
+ * The probe is an empty packet with the sequence number of the last acked one: the receiver has it already and acks it
+ * with its window right away, while new data would wait for room in its buffer.
+ * The timer starts at the retransmission timeout and doubles with every probe up to its upper bound.
+ * The retransmission timers do not run meanwhile.
+ * 
+ * @param queue 
+ * @param sockfd 
+ * @param tx 
+ * @param addr 
+ * @param addr_len 
+ * @param now 
+ * @param deadline 
+ * @return int 
+ */
+static int probe_window(struct packet_queue *queue, int sockfd,
+			struct io_batch *tx, struct sockaddr *addr,
+			socklen_t addr_len, uint64_t now, uint64_t *deadline)
+{
+	struct packet_t *first = queue_first(queue);
+	if (!first) {
+		*deadline = now + queue->rtt.rto;
+		return 0;
+	}
+
+	int res = 0;
+	if (!queue->probe_at) {
+		queue->probe_interval = queue->rtt.rto;
+	} else if (now >= queue->probe_at) {
+		struct packet_data probe;
+		memset(&probe, 0, PACKET_HEADER_SIZE);
+		probe.seq_num = first->data.seq_num - 1;
+		stat_add(queue->stats.probes, 1);
+		if (io_send(sockfd, tx, &probe, addr, addr_len) == -1 ||
+		    (res = io_flush(sockfd, tx)) == -1)
+			return -1;
+		queue->probe_interval *= 2;
+		if (queue->probe_interval > queue->rtt.max_rto)
+			queue->probe_interval = queue->rtt.max_rto;
+	} else {
+		*deadline = queue->probe_at;
+		return 0;
+	}
+
+	queue->probe_at = *deadline = now + queue->probe_interval;
+	return res;
+}
+
+/**
+ * @brief Sends the packets in the window of the given queue that are due, and returns the number of bytes sent or -1 on error.
+ * 
+ * @details The window is the first queue_window packets of the queue. Packets that were never sent are always due.
+ * In Go-Back-N mode, if the first packet timed out the whole window is due again.
+ * In Selective Repeat mode, every timed out packet that is not selectively acked is due.
+ * After DUP_ACK_THRESHOLD duplicate acks the first packet is due without waiting for its timeout,
+ * in Go-Back-N mode together with the rest of the window since the receiver dropped them.
+ * A timeout shrinks the congestion window before anything is resent, so only the reduced window is resent.
+ * With pacing on, a due packet that finds the token bucket empty ends the call, the rest of the window is sent
+ * when the bucket has refilled. The time of the next retransmission or of the pacer, whichever is earlier, is written to deadline.
+ * While the peer advertises a zero receive window nothing is sent but the probes of probe_window.
+ * The queue lock must be held, since the packets are read in place.
+ * 
+ * @param queue 
+ * @param mode 
+ * @param sockfd 
+ * @param tx 
+ * @param addr 
+ * @param addr_len 
+ * @param deadline 
+ * @return int 
+ */
+int send_window(struct packet_queue *queue, enum arq_mode mode, int sockfd,
+		struct io_batch *tx, struct sockaddr *addr, socklen_t addr_len,
+		uint64_t *deadline)
+{
+	uint64_t now = now_us();
+	if (!queue->peer_window)
+		return probe_window(queue, sockfd, tx, addr, addr_len, now,
+				    deadline);
+	queue->probe_at = 0;
+
+	/** Packets expire with the timeout they were sent with */
+	uint64_t rto = queue->rtt.rto;
+	char timed_out = window_timed_out(queue, mode, queue_window(queue), now);
+	/** Back off once per timeout, the retransmitted packets wait for the doubled timeout.
+	 * The window already collapsed, the losses of the packets sent before the timeout do not reduce it again. */
+	if (timed_out) {
+		stat_add(queue->stats.timeouts, 1);
+		queue->cc.ops->on_timeout(&queue->cc);
+		rtt_backoff(&queue->rtt);
+		queue->recover = queue->last_sent;
+	}
+	/** A fast retransmit is covered by the timeout resend */
+	char fast = queue->fast_retransmit && !timed_out;
+	queue->fast_retransmit = 0;
+	if (fast)
+		stat_add(queue->stats.fast_retransmits, 1);
+	unsigned int window = queue_window(queue);
+	*deadline = now + queue->rtt.rto;
+
+	/** Go back to the start of the window if its first packet timed out or is lost */
+	struct packet_t *first = queue_first(queue);
+	char go_back = mode == GO_BACK_N && (timed_out || fast);
+
+	int bytes_sent = 0;
+	int res, i = 0;
+	struct packet_t *packet = first;
+	for (; packet && i < window; packet = queue_next(queue, packet), i++) {
+		if (packet->acked)
+			continue;
+
+		char expired = packet->sent_at && now >= packet->sent_at + rto;
+		char due = !packet->sent_at || go_back ||
+			   (fast && packet == first) ||
+			   (mode == SELECTIVE_REPEAT && expired);
+		if (due) {
+			/** Leave the rest of the window to the pacer, a fast retransmit is kept for then.
+			 * Go-Back-N marks the packets left behind as not sent below, so they are sent again next time. */
+			uint64_t paced = pace_packet(queue, now,
+						     wire_size(&packet->data));
+			if (paced) {
+				stat_add(queue->stats.paced, 1);
+				if (paced < *deadline)
+					*deadline = paced;
+				if (fast && packet == first)
+					queue->fast_retransmit = 1;
+				break;
+			}
+			/** Duplicates of the lost first packet are counted again once the earlier ones are in */
+			if (packet == first && packet->sent_at)
+				expect_stale_acks(queue, packet);
+			/** Set last sent as the sequence number, this will eventually be equal to the last sent in the window */
+			if (packet->data.seq_num > queue->last_sent)
+				queue->last_sent = packet->data.seq_num;
+			packet->sent_at = now;
+			if (packet->transmissions++)
+				stat_add(queue->stats.retransmissions, 1);
+			stat_add(queue->stats.packets, 1);
+			stat_add(queue->stats.bytes, wire_size(&packet->data));
+			if (packet->payload)
+				res = io_send_mapped(sockfd, tx, &packet->data,
+						     packet->payload, addr,
+						     addr_len);
+			else
+				res = io_send(sockfd, tx, &packet->data, addr,
+					      addr_len);
+			if (res == -1)
+				return -1;
+			bytes_sent += res;
+		}
+
+		/** Go-Back-N only times the first packet of the window */
+		if ((mode == SELECTIVE_REPEAT || packet == first) &&
+		    packet->sent_at + queue->rtt.rto < *deadline)
+			*deadline = packet->sent_at + queue->rtt.rto;
+	}
+
+	/** The receiver dropped the packets after the lost one. The ones beyond the reduced window
+	 * are sent again like new packets as the window slides, instead of waiting for their timeout. */
+	if (go_back)
+		for (; packet && packet->sent_at;
+		     packet = queue_next(queue, packet))
+			packet->sent_at = 0;
+
+	/** Send the rest of the window with one call */
+	if ((res = io_flush(sockfd, tx)) == -1)
+		return -1;
+
+	return bytes_sent + res;
+}
+
+/**
+ * @brief Stores the given packet if it is in the receive window after the expected one. Returns 1 if stored.
+ * 
+ * @param buf 
+ * @param exp_seq_num 
+ * @param packet 
+ * @return int 
+ */
+int reorder_store(struct reorder_buffer *buf, unsigned int exp_seq_num,
+		  struct packet_data *packet)
+{
+	unsigned int ahead = packet->seq_num - exp_seq_num;
+	if (!ahead || ahead >= options.window)
+		return 0;
+
+	if (!buf->packets) {
+		buf->packets = malloc(options.window * sizeof(struct packet_data));
+		buf->present = calloc(options.window, sizeof(char));
+	}
+
+	unsigned int slot = packet->seq_num % options.window;
+	memcpy(&buf->packets[slot], packet, packet_size(packet));
+	buf->count += !buf->present[slot];
+	buf->present[slot] = 1;
+	return 1;
+}
+
+/**
+ * @brief Removes and returns the packet with the given sequence number from the buffer, NULL if it is not buffered.
+ * 
+ * @details The returned packet is valid until the next reorder_store call.
+ * 
+ * @param buf 
+ * @param seq_num 
+ * @return struct packet_data* 
+ */
+struct packet_data *reorder_take(struct reorder_buffer *buf,
+				 unsigned int seq_num)
+{
+	unsigned int slot = seq_num % options.window;
+	if (!buf->packets || !buf->present[slot] ||
+	    buf->packets[slot].seq_num != seq_num)
+		return NULL;
+
+	buf->present[slot] = 0;
+	buf->count--;
+	return &buf->packets[slot];
+}
+
+/**
+ * @brief Frees the storage of the given buffer
+ * 
+ * @param buf 
+ */
+void free_reorder_buffer(struct reorder_buffer *buf)
+{
+	free(buf->packets);
+	free(buf->present);
+	buf->packets = NULL;
+	buf->present = NULL;
+	buf->count = 0;
+}
+
+/**
+ * @brief Decides if the given cumulative ack is sent now. Returns 1 if it is, 0 if it is held back.
+ * 
+ * @details An ack is held back for a packet that is delivered in order on its own, until options.ack_every
+ * such packets arrive or options.ack_delay passes. A gap, a duplicate or a control packet is acked right away,
+ * and that ack also covers the held back one, so the sender sees the losses as fast as before.
+ * 
+ * @param delayed 
+ * @param ack 
+ * @param in_order 
+ * @return int 
+ */
+int delay_ack(struct delayed_ack *delayed, struct packet_data *ack,
+	      int in_order)
+{
+	if (!in_order || delayed->pending + 1 >= options.ack_every) {
+		delayed->pending = 0;
+		return 1;
+	}
+
+	if (!delayed->pending++)
+		delayed->deadline = now_us() + options.ack_delay;
+	delayed->seq_num = ack->seq_num;
+	return 0;
+}
+
+/**
+ * @brief Fills the given ack with the held back one if its deadline passed. Returns 1 if it did.
+ * 
+ * @param delayed 
+ * @param now 
+ * @param ack 
+ * @return int 
+ */
+int expired_ack(struct delayed_ack *delayed, uint64_t now,
+		struct packet_data *ack)
+{
+	if (!delayed->pending || delayed->deadline > now)
+		return 0;
+
+	memset(ack, 0, PACKET_HEADER_SIZE);
+	ack->is_ack = 1;
+	ack->seq_num = delayed->seq_num;
+	delayed->pending = 0;
+	return 1;
+}
+
+/**
+ * @brief Waits until the send buffer of the given queue has space and returns how many packets fit in it.
+ * 
+ * @details Acked packets make space, so the input blocks here while the network drains the queue at window speed.
+ * Only one thread may add to a queue while waiting, the space is for it alone. Packets added without waiting,
+ * such as the termination packet, are not limited.
+ * 
+ * @param queue 
+ * @return int 
+ */
+int wait_queue_space(struct packet_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->size >= queue->limit)
+		pthread_cond_wait(&queue->drained, &queue->mutex);
+	int space = queue->limit - queue->size;
+	pthread_mutex_unlock(&queue->mutex);
+
+	return space;
+}
+
+/**
+ * @brief Returns a copy of the pool counters of the given queue
+ * 
+ * @param queue 
+ * @return struct pool_stats 
+ */
+struct pool_stats queue_pool_stats(struct packet_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	struct pool_stats stats = queue->pool;
+	pthread_mutex_unlock(&queue->mutex);
+
+	return stats;
+}
+
+/** Marks a slot of a removed connection in the connection table */
+static struct connection_t tombstone;
+
+/**
+ * @brief Returns the port and the IP bytes of the given address
+ * 
+ * @param addr 
+ * @param port 
+ * @param ip_len 
+ * @return const unsigned char* 
+ */
+static const unsigned char *address_key(struct sockaddr *addr, uint16_t *port,
+					size_t *ip_len)
+{
+	switch (addr->sa_family) {
+	case AF_INET:
+		*port = ((struct sockaddr_in *)addr)->sin_port;
+		*ip_len = sizeof(struct in_addr);
+		return (unsigned char *)&((struct sockaddr_in *)addr)->sin_addr;
+	case AF_INET6:
+		*port = ((struct sockaddr_in6 *)addr)->sin6_port;
+		*ip_len = sizeof(struct in6_addr);
+		return (unsigned char *)&((struct sockaddr_in6 *)addr)->sin6_addr;
+	default:
+		*port = 0;
+		*ip_len = sizeof(addr->sa_data);
+		return (unsigned char *)addr->sa_data;
+	}
+}
+
+/**
+ * @brief Compares the (family, IP, port) of the given addresses. Returns 1 if they are equal.
+ * 
+ * @param a 
+ * @param b 
+ * @return int 
+ */
+static int address_equal(struct sockaddr *a, struct sockaddr *b)
+{
+	uint16_t a_port, b_port;
+	size_t a_len, b_len;
+	const unsigned char *a_ip = address_key(a, &a_port, &a_len);
+	const unsigned char *b_ip = address_key(b, &b_port, &b_len);
+
+	return a->sa_family == b->sa_family && a_port == b_port &&
+	       !memcmp(a_ip, b_ip, a_len);
+}
+
+/**
+ * @brief FNV-1a hash of the (family, IP, port) of the given address
+ * 
+ * @param addr 
+ * @return unsigned int 
+ */
+static unsigned int address_hash(struct sockaddr *addr)
+{
+	uint16_t port;
+	size_t ip_len;
+	const unsigned char *ip = address_key(addr, &port, &ip_len);
+
+	unsigned int hash = 2166136261u;
+	hash = (hash ^ addr->sa_family) * 16777619u;
+	hash = (hash ^ (port & 0xff)) * 16777619u;
+	hash = (hash ^ (port >> 8)) * 16777619u;
+	for (size_t i = 0; i < ip_len; i++)
+		hash = (hash ^ ip[i]) * 16777619u;
+
+	return hash;
+}
+
+/**
+ * @brief Initializes the given connection table with CONN_TABLE_CAPACITY slots
+ * 
+ * @param table 
+ */
+void init_connection_table(struct connection_table *table)
+{
+	table->slots = calloc(CONN_TABLE_CAPACITY, sizeof(struct connection_t *));
+	table->capacity = CONN_TABLE_CAPACITY;
+	table->count = table->removed = 0;
+}
+
+/**
+ * @brief Frees the slots of the given table. Connections are not freed.
+ * 
+ * @param table 
+ */
+void free_connection_table(struct connection_table *table)
+{
+	free(table->slots);
+	table->slots = NULL;
+	table->capacity = table->count = table->removed = 0;
+}
+
+/**
+ * @brief Finds and returns the connection with the given address in the given table. If not found, returns NULL.
+ * 
+ * @param table 
+ * @param addr 
+ * @return struct connection_t* 
+ */
+struct connection_t *find_connection(struct connection_table *table,
+				     struct sockaddr *addr)
+{
+	unsigned int mask = table->capacity - 1;
+	for (unsigned int i = address_hash(addr) & mask; table->slots[i];
+	     i = (i + 1) & mask) {
+		struct connection_t *conn = table->slots[i];
+		if (conn != &tombstone &&
+		    address_equal((struct sockaddr *)&conn->target_addr, addr))
+			return conn;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Places the given connection to the first free slot of its probe chain
+ * 
+ * @param table 
+ * @param conn 
+ */
+static void place_connection(struct connection_table *table,
+			     struct connection_t *conn)
+{
+	unsigned int mask = table->capacity - 1;
+	unsigned int i =
+		address_hash((struct sockaddr *)&conn->target_addr) & mask;
+	while (table->slots[i] && table->slots[i] != &tombstone)
+		i = (i + 1) & mask;
+
+	if (table->slots[i] == &tombstone)
+		table->removed--;
+	table->slots[i] = conn;
+	table->count++;
+}
+
+/**
+ * @brief Rehashes the given table, dropping the tombstones. Doubles the capacity if it is at least a quarter full.
+ * 
+ * @param table 
+ */
+static void rehash_connection_table(struct connection_table *table)
+{
+	struct connection_t **slots = table->slots;
+	unsigned int capacity = table->capacity;
+
+	if (table->count * 4 >= capacity)
+		table->capacity *= 2;
+	table->slots = calloc(table->capacity, sizeof(struct connection_t *));
+	table->count = table->removed = 0;
+
+	for (unsigned int i = 0; i < capacity; i++)
+		if (slots[i] && slots[i] != &tombstone)
+			place_connection(table, slots[i]);
+
+	free(slots);
+}
+
+/**
+ * @brief Inserts the given connection to the given table. The address must not be in the table.
+ * 
+ * @param table 
+ * @param conn 
+ */
+void insert_connection(struct connection_table *table,
+		       struct connection_t *conn)
+{
+	/** Keep the load below a half so the probe chains stay short */
+	if ((table->count + table->removed + 1) * 2 > table->capacity)
+		rehash_connection_table(table);
+
+	place_connection(table, conn);
+}
+
+/**
+ * @brief Removes the given connection from the given table. The connection is not freed.
+ * 
+ * @param table 
+ * @param conn 
+ */
+void remove_connection(struct connection_table *table,
+		       struct connection_t *conn)
+{
+	unsigned int mask = table->capacity - 1;
+	unsigned int i =
+		address_hash((struct sockaddr *)&conn->target_addr) & mask;
+	for (; table->slots[i]; i = (i + 1) & mask) {
+		if (table->slots[i] == conn) {
+			table->slots[i] = &tombstone;
+			table->count--;
+			table->removed++;
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Adds and returns a new connection to the given list.
+ * 
+ * @param list 
+ * @param addr 
+ * @param addr_len 
+ * @return struct connection_t* 
+ */
+struct connection_t *add_connection(struct connection_t *list,
+				    struct sockaddr *addr, socklen_t addr_len)
+{
+	struct connection_t *new_elem = calloc(1, sizeof(struct connection_t));
+	memcpy(&new_elem->target_addr, addr, addr_len);
+	new_elem->target_addr_len = addr_len;
+	init_queue(&new_elem->queue);
+	new_elem->next = new_elem->prev = NULL;
+	new_elem->is_active = 1;
+
+	if (!list) {
+		new_elem->id = 0;
+		return new_elem;
+	}
+
+	while (list->next)
+		list = list->next;
+
+	new_elem->id = list->id + 1;
+	new_elem->prev = list;
+
+	list->next = new_elem;
+	return new_elem;
+}
+
+/**
+ * @brief Deletes the given connection from the list
+ * 
+ * @param conn 
+ */
+void delete_connection(struct connection_t *conn)
+{
+	conn->prev->next = conn->next;
+	conn->next->prev = conn->prev;
 
 	free(conn);
 }
@@ -209,10 +1582,157 @@ void free_connection_list(struct connection_t *last)
 {
 	struct connection_t *temp;
 	while (last) {
-		free_queue(&last->queue);
+		destroy_queue(&last->queue);
+		free_reorder_buffer(&last->reorder);
 
 		temp = last;
 		last = last->prev;
 		free(temp);
 	}
 }
+
+/**
+ * @brief Initializes the given timer heap with TIMER_HEAP_CAPACITY slots
+ * 
+ * @param heap 
+ */
+void init_timer_heap(struct timer_heap *heap)
+{
+	heap->conns = calloc(TIMER_HEAP_CAPACITY, sizeof(struct connection_t *));
+	heap->capacity = TIMER_HEAP_CAPACITY;
+	heap->count = 0;
+}
+
+/**
+ * @brief Frees the slots of the given heap. Connections are not freed.
+ * 
+ * @param heap 
+ */
+void free_timer_heap(struct timer_heap *heap)
+{
+	free(heap->conns);
+	heap->conns = NULL;
+	heap->capacity = heap->count = 0;
+}
+
+/**
+ * @brief Puts the given connection to the given slot of the heap and records the slot in the connection
+ * 
+ * @param heap 
+ * @param i 
+ * @param conn 
+ */
+static void heap_place(struct timer_heap *heap, unsigned int i,
+		       struct connection_t *conn)
+{
+	heap->conns[i] = conn;
+	conn->heap_index = i + 1;
+}
+
+/**
+ * @brief Moves the connection in the given slot up until its parent is not later
+ * 
+ * @param heap 
+ * @param i 
+ */
+static void heap_sift_up(struct timer_heap *heap, unsigned int i)
+{
+	struct connection_t *conn = heap->conns[i];
+	while (i) {
+		unsigned int parent = (i - 1) / 2;
+		if (heap->conns[parent]->deadline <= conn->deadline)
+			break;
+		heap_place(heap, i, heap->conns[parent]);
+		i = parent;
+	}
+	heap_place(heap, i, conn);
+}
+
+/**
+ * @brief Moves the connection in the given slot down until its children are not earlier
+ * 
+ * @param heap 
+ * @param i 
+ */
+static void heap_sift_down(struct timer_heap *heap, unsigned int i)
+{
+	struct connection_t *conn = heap->conns[i];
+	while (1) {
+		unsigned int child = 2 * i + 1;
+		if (child >= heap->count)
+			break;
+		if (child + 1 < heap->count &&
+		    heap->conns[child + 1]->deadline < heap->conns[child]->deadline)
+			child++;
+		if (conn->deadline <= heap->conns[child]->deadline)
+			break;
+		heap_place(heap, i, heap->conns[child]);
+		i = child;
+	}
+	heap_place(heap, i, conn);
+}
+
+/**
+ * @brief Schedules the given connection at the given deadline, or moves it there if it is already scheduled
+ * 
+ * @param heap 
+ * @param conn 
+ * @param deadline 
+ */
+void schedule_connection(struct timer_heap *heap, struct connection_t *conn,
+			 uint64_t deadline)
+{
+	if (conn->heap_index) {
+		uint64_t old = conn->deadline;
+		conn->deadline = deadline;
+		if (deadline < old)
+			heap_sift_up(heap, conn->heap_index - 1);
+		else
+			heap_sift_down(heap, conn->heap_index - 1);
+		return;
+	}
+
+	if (heap->count == heap->capacity) {
+		heap->capacity *= 2;
+		heap->conns = realloc(heap->conns, heap->capacity *
+							   sizeof(struct connection_t *));
+	}
+
+	conn->deadline = deadline;
+	heap->conns[heap->count] = conn;
+	heap_sift_up(heap, heap->count++);
+}
+
+/**
+ * @brief Removes the given connection from the heap if it is scheduled
+ * 
+ * @param heap 
+ * @param conn 
+ */
+void unschedule_connection(struct timer_heap *heap, struct connection_t *conn)
+{
+	if (!conn->heap_index)
+		return;
+
+	unsigned int i = conn->heap_index - 1;
+	conn->heap_index = 0;
+	struct connection_t *last = heap->conns[--heap->count];
+	if (i == heap->count)
+		return;
+
+	/** Fill the hole with the last connection, it may need to move either way */
+	heap_place(heap, i, last);
+	heap_sift_up(heap, i);
+	heap_sift_down(heap, last->heap_index - 1);
+}
+
+/**
+ * @brief Returns the connection with the earliest deadline, NULL if no connection is scheduled
+ * 
+ * @param heap 
+ * @return struct connection_t* 
+ */
+struct connection_t *next_timer(struct timer_heap *heap)
+{
+	return heap->count ? heap->conns[0] : NULL;
+}
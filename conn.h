@@ -13,37 +13,168 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
-/** Set window size and char buffer size */
-#define WINDOW_SIZE 16
-#define PAYLOAD_SIZE 9
+#include "cc.h"
+#include "stats.h"
+#include "wake.h"
+
+/** Default receive window in packets. The sender window is the smaller of the congestion window
+ * and the receive window of the peer, which is exchanged with the init packets and then advertised with every ack. */
+#define WINDOW_SIZE 64
+/** Largest receive window that can be configured */
+#define MAX_WINDOW_SIZE 4096
+/** Largest payload, fits a 1500 byte Ethernet MTU together with the IPv4, UDP and wire headers.
+ * The payload size actually used is negotiated per connection with the init packets. */
+#define MAX_PAYLOAD_SIZE 1464
+
+/** Retransmission timeout before the first round trip time sample, and the default bounds, in microseconds */
+#define INITIAL_RTO 100000
+#define MIN_RTO 1000
+#define MAX_RTO 2000000
+
+/** Duplicate cumulative acks that make the sender resend the first packet of the window without waiting for its timeout */
+#define DUP_ACK_THRESHOLD 3
+
+/** Default in-order packets acked with one cumulative ack, and the longest time an ack is held back in microseconds */
+#define ACK_EVERY 2
+#define ACK_DELAY 500
+
+/**
+ * @struct rtt_estimator
+ * 
+ * @brief Retransmission timeout computed from round trip time samples as in RFC 6298. Times are in microseconds.
+ * 
+ * @details Only packets sent once are sampled (Karn's rule), since the ack of a retransmitted packet
+ * cannot be matched to one transmission. Every timeout doubles the timeout until the next sample.
+ * 
+ */
+struct rtt_estimator {
+	/** Smoothed round trip time and its variation */
+	uint64_t srtt;
+	uint64_t rttvar;
+	/** Current retransmission timeout and its bounds */
+	uint64_t rto;
+	uint64_t min_rto;
+	uint64_t max_rto;
+};
+
+/** Pacing gain of the auto rate in percent of the congestion window per smoothed round trip time, in slow start and after it */
+#define PACING_GAIN_SLOW_START 200
+#define PACING_GAIN 125
+/** Depth of the token bucket: the bytes of this many microseconds at the pacing rate, but at least PACING_MIN_BURST packets */
+#define PACING_BURST_TIME 1000
+#define PACING_MIN_BURST 2
+/** Value of options.pacing that derives the rate from the congestion window */
+#define PACING_AUTO -1
+
+/**
+ * @struct pacer
+ * 
+ * @brief Token bucket that spreads the packets of a window over the round trip instead of sending them back to back.
+ * 
+ * @details The bucket fills at the pacing rate up to its depth, and a packet may leave while it is not empty,
+ * taking its wire size out. Tokens are kept in bytes times 10^6, so the refill of a microsecond is not rounded away at low rates.
+ * 
+ */
+struct pacer {
+	/** Tokens, negative while the last packet is paid off, and the time they were counted at */
+	int64_t tokens;
+	uint64_t last;
+};
+
+/** These functions will be explained in conn.c */
+void init_rtt(struct rtt_estimator *rtt, uint64_t min_rto, uint64_t max_rto);
+void rtt_sample(struct rtt_estimator *rtt, uint64_t sample);
+void rtt_backoff(struct rtt_estimator *rtt);
+
+/**
+ * @enum arq_mode
+ * 
+ * @brief Retransmission scheme of a sender and the matching receiver behaviour.
+ * 
+ * @details Go-Back-N resends the whole window when the oldest packet times out and the receiver drops out of order packets.
+ * Selective Repeat keeps a timer per packet, resends only the timed out ones that were not selectively acked,
+ * and the receiver buffers out of order packets in the window and acks each of them.
+ * 
+ */
+enum arq_mode { GO_BACK_N, SELECTIVE_REPEAT };
+
+/** Receive windows of packets a queue preallocates, sized from options.window when the queue is initialized.
+ * The ring doubles when the input thread outruns the window up to the send buffer, so this only sets the preallocation. */
+#define QUEUE_WINDOWS 2
+/** Default send buffer of a connection in bytes. Holds more than the largest window of full packets, so the window is not starved. */
+#define SEND_BUFFER_SIZE (8 << 20)
 
 /**
  * @struct packet_data
  * 
  * @brief Packet structure. Has fields for marking ack, init and termination. seq_num is the sequence number.
  * 
+ * @details This is the layout in memory. On the wire the packet starts with a WIRE_HEADER_SIZE byte header,
+ * which is written and read by encode_header and decode_header, followed by len bytes of payload
+ * and, with --checksum, a CHECKSUM_SIZE byte trailer.
+ * 
  */
 struct packet_data {
-	/** Payload */
-	char char_seq[PAYLOAD_SIZE];
 	/** Set if the packet is ack */
 	char is_ack;
 	/** Set if the packet is initializing a connection */
 	char init_conn;
 	/** Set if the packet is terminating a connection */
 	char terminate_conn;
+	/** Payload length. Only the header and len bytes of the payload are sent. */
+	unsigned short len;
 	/** Sequence number
 	 * In this implementation the sequence number directly shows the packet number,
-	 * since the packet size does not change and would be incremented with the same number every time. */
+	 * and would be incremented with the same number every time. */
 	unsigned int seq_num;
+	/** Payload. Init packets and their acks carry the segment size and the receive window instead of data,
+	 * the other acks the sequence number of the packet they selectively acknowledge (0 if none) and the receive window. */
+	char char_seq[MAX_PAYLOAD_SIZE];
 };
 
+/** Size of the fields before the payload */
+#define PACKET_HEADER_SIZE offsetof(struct packet_data, char_seq)
+
+/** Wire header: version, flags, payload length and sequence number, the last two in network byte order */
+#define WIRE_HEADER_SIZE 8
+/** Version of the wire format. Datagrams with another version are dropped as malformed. */
+#define WIRE_VERSION 2
+/** Bits of the flags byte */
+#define WIRE_ACK 0x01
+#define WIRE_INIT 0x02
+#define WIRE_TERMINATE 0x04
+/** Set if a CRC32C of the header and the payload follows the payload, in network byte order */
+#define WIRE_CHECKSUM 0x08
+#define CHECKSUM_SIZE 4
+/** Payload of an ack that is not an init ack: selectively acked sequence number and receive window, in network byte order */
+#define ACK_PAYLOAD_SIZE 6
+
+/** These functions will be explained in conn.c */
+uint64_t now_us(void);
+size_t packet_size(struct packet_data *packet);
+size_t wire_size(struct packet_data *packet);
+int has_checksum(struct packet_data *packet);
+void encode_header(struct packet_data *packet, unsigned char *wire);
+void seal_packet(const unsigned char *wire, const char *payload, size_t len,
+		 unsigned char *trailer);
+int decode_header(const unsigned char *wire, size_t bytes,
+		  struct packet_data *packet);
+void set_handshake(struct packet_data *packet, unsigned short seg_size,
+		   unsigned short window);
+void get_handshake(struct packet_data *packet, unsigned short *seg_size,
+		   unsigned short *window);
+void set_ack_payload(struct packet_data *ack, unsigned int sack_seq,
+		     unsigned short window);
+unsigned int get_sack_seq(struct packet_data *ack);
+int get_ack_window(struct packet_data *ack);
+
 /**
  * @struct packet_t
  * 
@@ -52,39 +183,185 @@ struct packet_data {
  */
 struct packet_t {
 	struct packet_data data;
+	/** Payload in a mapped file, sent instead of data.char_seq. Only the header is copied to data. */
+	const char *payload;
+	/** Time of the last transmission in microseconds, 0 if the packet is not sent yet */
+	uint64_t sent_at;
+	/** Number of times the packet is sent */
+	unsigned int transmissions;
+	/** Set if the packet is selectively acknowledged */
+	char acked;
+#ifdef QUEUE_LIST
 	struct packet_t *next;
 	struct packet_t *prev;
+#endif
+};
+
+/**
+ * @struct pool_stats
+ * 
+ * @brief Packet node pool counters, used for sizing QUEUE_WINDOWS.
+ * 
+ */
+struct pool_stats {
+	/** Packets stored in an already allocated node */
+	unsigned long hits;
+	/** Packets that made the pool allocate more nodes */
+	unsigned long misses;
+	/** Most packets queued at the same time */
+	unsigned int high_water;
 };
 
+#ifdef QUEUE_LIST
+/**
+ * @struct pool_slab
+ * 
+ * @brief A block of packet nodes allocated at once by the list queue pool.
+ * 
+ */
+struct pool_slab {
+	struct pool_slab *next;
+	struct packet_t nodes[];
+};
+#endif
+
 /**
  * @struct packet_queue
  * 
- * @brief Linked list queue for storing packets.
+ * @brief Ring buffer queue for storing packets.
  * 
  * @details Outgoing packets are queued in using this structure.
  * This struct will be filled with packages that comes from the user input thread.
  * Ack deletes from the item to the end.
  * 
+ * Packets are stored contiguously and indexed by seq_num % capacity, so finding the acked packet
+ * and sliding the window are O(1). Building with -DQUEUE_LIST selects the old doubly-linked list instead.
+ * 
  */
 struct packet_queue {
 	/** Queue size */
 	int size;
 	/** Last sent sequence number. Used to determine the seq. number if the queue is empty. */
 	unsigned int last_sent;
-	/** Queue mutex */
+	/** Queue mutex. Guards the window too, it is the only lock the sender, the acks and the input take for it,
+	 * so the connections of the server do not serialize against each other. */
 	pthread_mutex_t mutex;
+	/** Signaled when acked packets leave the queue, for the input waiting for space */
+	pthread_cond_t drained;
+	/** Packets the input may queue, the send buffer divided by the memory of a packet */
+	int limit;
+#ifdef QUEUE_LIST
 	/** First and last elements of the queue */
 	struct packet_t *head;
 	struct packet_t *tail;
+	/** Node pool. Free nodes are chained through next, slabs are freed with the queue. */
+	struct packet_t *free_nodes;
+	struct pool_slab *slabs;
+	/** Nodes allocated at once, the first slab is preallocated */
+	unsigned int slab_size;
+#else
+	/** Ring storage and its capacity (a power of two) */
+	struct packet_t *ring;
+	unsigned int capacity;
+	/** Sequence number of the first element of the queue */
+	unsigned int head_seq;
+#endif
+	/** Pool counters. In the ring build the ring is the pool and growing it is a miss. */
+	struct pool_stats pool;
+	/** Retransmission timeout of the packets in this queue */
+	struct rtt_estimator rtt;
+	/** Congestion window of the packets in this queue */
+	struct congestion cc;
+	/** Receive window of the peer in packets, from the handshake and then from the latest ack */
+	unsigned int peer_window;
+	/** Persist timer while the peer window is zero: time of the next probe and the interval it was set with, 0 if not running */
+	uint64_t probe_at;
+	uint64_t probe_interval;
+	/** Duplicate cumulative acks since the window last slid or its first packet was resent.
+	 * Negative while the duplicates caused by the packets sent before the resend can still arrive. */
+	int dup_acks;
+	/** Last sequence number sent when the last loss was detected. The congestion window is not
+	 * reduced again for the losses before it, so it shrinks once per window of losses. */
+	unsigned int recover;
+	/** Set when the first packet of the window is due for a fast retransmit */
+	char fast_retransmit;
+	/** Spaces the packets of the window when pacing is on */
+	struct pacer pacer;
+	/** Counters of the sender, explained in stats.h */
+	struct send_stats stats;
 };
 
 /** These functions will be explained in conn.c */
+void init_queue(struct packet_queue *queue);
 struct packet_t *find_packet(struct packet_queue *queue, int seq_num);
+struct packet_t *queue_first(struct packet_queue *queue);
+struct packet_t *queue_next(struct packet_queue *queue,
+			    struct packet_t *packet);
 struct packet_t *add_packet(struct packet_queue *queue,
 			    struct packet_data *data);
-int acknowledge_packet(struct packet_queue *queue, int seq_num,
-		       pthread_mutex_t *mutex);
+struct packet_t *add_mapped_packet(struct packet_queue *queue,
+				   struct packet_data *header,
+				   const char *payload);
+int acknowledge_packet(struct packet_queue *queue, int seq_num, int window);
+int selective_ack_packet(struct packet_queue *queue, int seq_num);
+unsigned int queue_window(struct packet_queue *queue);
 void free_queue(struct packet_queue *queue);
+int wait_queue_space(struct packet_queue *queue);
+void destroy_queue(struct packet_queue *queue);
+struct pool_stats queue_pool_stats(struct packet_queue *queue);
+
+struct io_batch;
+int send_window(struct packet_queue *queue, enum arq_mode mode, int sockfd,
+		struct io_batch *tx, struct sockaddr *addr, socklen_t addr_len,
+		uint64_t *deadline);
+
+/**
+ * @struct reorder_buffer
+ * 
+ * @brief Selective Repeat receiver buffer for the packets that arrive before the expected one.
+ * 
+ * @details Holds the receive window of packets after the expected one, indexed by seq_num % window.
+ * The storage is allocated by the first stored packet, so it costs nothing in Go-Back-N mode.
+ * 
+ */
+struct reorder_buffer {
+	struct packet_data *packets;
+	/** Set for the slots holding a packet */
+	char *present;
+	/** Packets held */
+	int count;
+};
+
+/** These functions will be explained in conn.c */
+int reorder_store(struct reorder_buffer *buf, unsigned int exp_seq_num,
+		  struct packet_data *packet);
+struct packet_data *reorder_take(struct reorder_buffer *buf,
+				 unsigned int seq_num);
+void free_reorder_buffer(struct reorder_buffer *buf);
+
+/**
+ * @struct delayed_ack
+ * 
+ * @brief Cumulative ack held back by a receiver until more packets arrive in order or its deadline passes.
+ * 
+ */
+struct delayed_ack {
+	/** In-order packets not acked yet, 0 if no ack is held back */
+	int pending;
+	/** Cumulative sequence number of the held back ack */
+	unsigned int seq_num;
+	/** Time the held back ack must be sent by */
+	uint64_t deadline;
+};
+
+/** These functions will be explained in conn.c */
+int delay_ack(struct delayed_ack *delayed, struct packet_data *ack,
+	      int in_order);
+int expired_ack(struct delayed_ack *delayed, uint64_t now,
+		struct packet_data *ack);
+
+/** Explained in file.h */
+struct delivery_buffer;
 
 /**
  * @struct connection_t
@@ -100,33 +377,106 @@ struct connection_t {
 	char is_active;
 	/** Connection id*/
 	int id;
+	/** Index of the server shard that owns the connection */
+	int shard;
 	/** Sequence number that the connection expects */
 	unsigned int exp_seq_num;
+	/** Payload size negotiated with the init packet */
+	unsigned short seg_size;
+	/** Buffer the data of the client is delivered to, the one of its shard.
+	 * NULL if it goes to the --output file, which the first connection takes. */
+	struct delivery_buffer *delivery;
+	/** Out of order packets from the client, used in Selective Repeat mode */
+	struct reorder_buffer reorder;
 	/** Thread for the connection */
 	pthread_t thread_id;
 	/** Client address */
-	struct sockaddr target_addr;
+	struct sockaddr_storage target_addr;
 	socklen_t target_addr_len;
-	/** Condition to signal a new item if the queue is empty */
-	pthread_cond_t cond;
 	/** Queue of the packets that will be sent with this connection */
 	struct packet_queue queue;
+	/** Counters of the datagrams received from the client, explained in stats.h */
+	struct recv_stats recv_stats;
 
-	/** Timedout wait mutex and condition */
-	pthread_mutex_t timeout_mutex;
-	pthread_cond_t timeout_cond;
+	/** Wakes the sender thread up when packets are added to the queue or acked */
+	struct wakeup wakeup;
+
+	/** Event core: time of the next retransmission and the position in the timer heap, 0 if not scheduled */
+	uint64_t deadline;
+	unsigned int heap_index;
+	/** Event core: set while the connection waits in the ready list to send */
+	char ready;
+	struct connection_t *next_ready;
+	/** Ack held back until more packets arrive, and the position in the held ack list of the shard */
+	struct delayed_ack delayed;
+	char ack_held;
+	struct connection_t *next_ack;
 
 	/** Next and previous elements of the connection list */
 	struct connection_t *next;
 	struct connection_t *prev;
 };
 
+/** Initial slot count of the connection table. Must be a power of two. */
+#define CONN_TABLE_CAPACITY 64
+
+/**
+ * @struct connection_table
+ * 
+ * @brief Open addressing hash table of connections, keyed on the (family, IP, port) of the client.
+ * 
+ * @details Collisions are resolved with linear probing. Removed connections leave a tombstone
+ * so that probe chains stay intact, the slot is reused by the next insertion.
+ * The table is rehashed to double size when live entries and tombstones fill half of it.
+ * 
+ */
+struct connection_table {
+	/** Slots, NULL if never used */
+	struct connection_t **slots;
+	unsigned int capacity;
+	/** Number of live connections */
+	unsigned int count;
+	/** Number of tombstones */
+	unsigned int removed;
+};
+
+/** Initial capacity of the timer heap. Grows by doubling. */
+#define TIMER_HEAP_CAPACITY 64
+
+/**
+ * @struct timer_heap
+ * 
+ * @brief Binary min-heap of connections ordered by their next retransmission deadline.
+ * 
+ * @details Used by the event core of the server, where one timer serves every connection.
+ * Each connection keeps its position, so rescheduling and removing are O(log n).
+ * 
+ */
+struct timer_heap {
+	struct connection_t **conns;
+	unsigned int capacity;
+	unsigned int count;
+};
+
 /** These functions will be explained in conn.c */
-struct connection_t *find_connection(struct connection_t *list,
+void init_connection_table(struct connection_table *table);
+void free_connection_table(struct connection_table *table);
+struct connection_t *find_connection(struct connection_table *table,
 				     struct sockaddr *addr);
+void insert_connection(struct connection_table *table,
+		       struct connection_t *conn);
+void remove_connection(struct connection_table *table,
+		       struct connection_t *conn);
 struct connection_t *add_connection(struct connection_t *list,
 				    struct sockaddr *addr, socklen_t addr_len);
 void delete_connection(struct connection_t *conn);
 void free_connection_list(struct connection_t *last);
+void init_timer_heap(struct timer_heap *heap);
+void free_timer_heap(struct timer_heap *heap);
+void schedule_connection(struct timer_heap *heap, struct connection_t *conn,
+			 uint64_t deadline);
+void unschedule_connection(struct timer_heap *heap,
+			   struct connection_t *conn);
+struct connection_t *next_timer(struct timer_heap *heap);
 
 #endif // !__CONN__
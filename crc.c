@@ -0,0 +1,197 @@
+/**
+ * @file crc.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief CRC32C checksum implementation
+ * 
+ * @details The checksum is computed with the crc32 instructions of SSE4.2 on x86-64 and of the CRC extension on ARMv8
+ * when the processor has them, which is checked once at run time. Otherwise a slicing-by-8 table is used,
+ * which reads 8 bytes per step with 8 table lookups.
+ * The functions chain like zlib's crc32: start with 0 and pass the result of the previous part to continue.
+ * 
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+/** Slicing-by-8 tables, table[k][b] is the CRC of byte b followed by k zero bytes */
+static uint32_t table[8][256];
+/** Implementation chosen for the processor, and its name */
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *data, size_t len);
+static const char *impl_name;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Slicing-by-8 CRC32C of the given data, continued from the given CRC. Reads the bytes one by one, so it does not depend on the byte order.
+ * 
+ * @param crc 
+ * @param data 
+ * @param len 
+ * @return uint32_t 
+ */
+static uint32_t table_crc(uint32_t crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t c = ~crc;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		c ^= p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		c = table[7][c & 0xff] ^ table[6][(c >> 8) & 0xff] ^
+		    table[5][(c >> 16) & 0xff] ^ table[4][c >> 24] ^
+		    table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^
+		    table[0][p[7]];
+	}
+	while (len--)
+		c = table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+
+	return ~c;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief CRC32C of the given data with the SSE4.2 crc32 instruction, 8 bytes per instruction
+ * 
+ * @param crc 
+ * @param data 
+ * @param len 
+ * @return uint32_t 
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+hardware_crc(uint32_t crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t c = ~crc;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		c = _mm_crc32_u64(c, word);
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+
+	return ~(uint32_t)c;
+}
+
+/**
+ * @brief Returns 1 if the processor has the crc32 instruction
+ * 
+ * @return int 
+ */
+static int has_hardware_crc(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#define HARDWARE_CRC_NAME "sse4.2"
+
+#elif defined(__aarch64__)
+/**
+ * @brief CRC32C of the given data with the ARMv8 crc32c instructions, 8 bytes per instruction
+ * 
+ * @param crc 
+ * @param data 
+ * @param len 
+ * @return uint32_t 
+ */
+__attribute__((target("+crc"))) static uint32_t
+hardware_crc(uint32_t crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t c = ~crc;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		c = __crc32cd(c, word);
+	}
+	while (len--)
+		c = __crc32cb(c, *p++);
+
+	return ~c;
+}
+
+/**
+ * @brief Returns 1 if the processor has the crc32c instructions
+ * 
+ * @return int 
+ */
+static int has_hardware_crc(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#define HARDWARE_CRC_NAME "armv8-crc"
+#endif
+
+/**
+ * @brief Builds the tables and chooses the implementation, called once
+ * 
+ */
+static void crc32c_init(void)
+{
+	for (int b = 0; b < 256; b++) {
+		uint32_t c = b;
+		for (int bit = 0; bit < 8; bit++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		table[0][b] = c;
+	}
+	for (int b = 0; b < 256; b++)
+		for (int k = 1; k < 8; k++)
+			table[k][b] = (table[k - 1][b] >> 8) ^
+				      table[0][table[k - 1][b] & 0xff];
+
+	crc32c_impl = &table_crc;
+	impl_name = "table";
+#ifdef HARDWARE_CRC_NAME
+	if (has_hardware_crc()) {
+		crc32c_impl = &hardware_crc;
+		impl_name = HARDWARE_CRC_NAME;
+	}
+#endif
+}
+
+/**
+ * @brief Returns the CRC32C of the given data, continued from the given CRC (0 for the first part)
+ * 
+ * @param crc 
+ * @param data 
+ * @param len 
+ * @return uint32_t 
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&crc_once, &crc32c_init);
+	return crc32c_impl(crc, data, len);
+}
+
+/**
+ * @brief Like crc32c, but always uses the table. Used to compare the implementations.
+ * 
+ * @param crc 
+ * @param data 
+ * @param len 
+ * @return uint32_t 
+ */
+uint32_t crc32c_table(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&crc_once, &crc32c_init);
+	return table_crc(crc, data, len);
+}
+
+/**
+ * @brief Returns the name of the implementation crc32c uses
+ * 
+ * @return const char* 
+ */
+const char *crc32c_name(void)
+{
+	pthread_once(&crc_once, &crc32c_init);
+	return impl_name;
+}
@@ -0,0 +1,22 @@
+/**
+ * @file crc.h
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief CRC32C checksum interface.
+ * 
+ */
+
+#ifndef __CRC__
+#define __CRC__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** CRC32C (Castagnoli) polynomial, reflected */
+#define CRC32C_POLY 0x82F63B78
+
+/** These functions will be explained in crc.c */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+uint32_t crc32c_table(uint32_t crc, const void *data, size_t len);
+const char *crc32c_name(void);
+
+#endif // !__CRC__
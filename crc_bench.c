@@ -0,0 +1,131 @@
+/**
+ * @file crc_bench.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Microbenchmark of the CRC32C implementations, used by make crcbench.
+ * 
+ * @details Checks both implementations against the standard check value, then checksums a buffer in chunks of the given
+ * sizes and prints one JSON line per size with the throughput of the chosen implementation, the table and memcpy.
+ * memcpy is the reference: the receiver copies every payload once anyway, so a checksum at memcpy speed adds one more pass.
+ * cost_per_gbit is the share of one core a checksummed 1 Gbit/s stream takes.
+ * 
+ * Usage: crc_benchmark [sizes...]
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc.h"
+
+/** Bytes checksummed per measurement, larger than the caches so the data comes from memory like the packets do */
+#define CRC_BENCH_BUFFER (64 << 20)
+/** Seconds each implementation is run for */
+#define CRC_BENCH_SECONDS 0.3
+/** CRC32C of "123456789" */
+#define CRC32C_CHECK 0xE3069283
+
+/**
+ * @brief Returns the monotonic time in seconds
+ * 
+ * @return double 
+ */
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Keeps the results alive so the compiler does not drop the work */
+static volatile uint32_t sink;
+
+/**
+ * @brief Returns the throughput in GB/s of the given CRC function over the buffer in chunks of the given size
+ * 
+ * @param crc 
+ * @param buffer 
+ * @param size 
+ * @return double 
+ */
+static double measure_crc(uint32_t (*crc)(uint32_t, const void *, size_t),
+			  const char *buffer, size_t size)
+{
+	size_t chunks = CRC_BENCH_BUFFER / size;
+	double bytes = 0;
+	double start = now_s(), elapsed;
+	do {
+		uint32_t sum = 0;
+		for (size_t i = 0; i < chunks; i++)
+			sum ^= crc(0, buffer + i * size, size);
+		sink = sum;
+		bytes += (double)chunks * size;
+	} while ((elapsed = now_s() - start) < CRC_BENCH_SECONDS);
+
+	return bytes / elapsed / 1e9;
+}
+
+/**
+ * @brief Returns the throughput in GB/s of memcpy from the buffer in chunks of the given size
+ * 
+ * @param buffer 
+ * @param size 
+ * @return double 
+ */
+static double measure_memcpy(const char *buffer, size_t size)
+{
+	char *copy = malloc(size);
+	size_t chunks = CRC_BENCH_BUFFER / size;
+	double bytes = 0;
+	double start = now_s(), elapsed;
+	do {
+		for (size_t i = 0; i < chunks; i++) {
+			memcpy(copy, buffer + i * size, size);
+			sink = copy[size - 1];
+		}
+		bytes += (double)chunks * size;
+	} while ((elapsed = now_s() - start) < CRC_BENCH_SECONDS);
+
+	free(copy);
+	return bytes / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	if (crc32c(0, "123456789", 9) != CRC32C_CHECK ||
+	    crc32c_table(0, "123456789", 9) != CRC32C_CHECK ||
+	    crc32c(crc32c(0, "1234", 4), "56789", 5) != CRC32C_CHECK) {
+		fprintf(stderr, "CRC32C check value mismatch\n");
+		return EXIT_FAILURE;
+	}
+
+	char *buffer = malloc(CRC_BENCH_BUFFER);
+	for (size_t i = 0; i < CRC_BENCH_BUFFER; i++)
+		buffer[i] = rand();
+
+	/** A full packet by default, then a small one and a large block */
+	static const char *default_sizes[] = { "1464", "64", "65536" };
+	const char **sizes = argc > 1 ? (const char **)argv + 1 : default_sizes;
+	int count = argc > 1 ? argc - 1 :
+			       sizeof(default_sizes) / sizeof(*default_sizes);
+
+	for (int i = 0; i < count; i++) {
+		size_t size = strtoul(sizes[i], 0, 10);
+		if (!size || size > CRC_BENCH_BUFFER) {
+			fprintf(stderr, "Usage: crc_benchmark [sizes...]\n");
+			return EXIT_FAILURE;
+		}
+
+		double chosen = measure_crc(crc32c, buffer, size);
+		double table = measure_crc(crc32c_table, buffer, size);
+		double copy = measure_memcpy(buffer, size);
+		printf("{\"size\":%zu,\"implementation\":\"%s\",\"crc_gbit_s\":%.3f,\"table_gbit_s\":%.3f,\"memcpy_gbit_s\":%.3f,"
+		       "\"ns_per_chunk\":%.1f,\"cost_per_gbit\":%.5f}\n",
+		       size, crc32c_name(), chosen * 8, table * 8, copy * 8,
+		       size / chosen, 1 / (chosen * 8));
+	}
+
+	free(buffer);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,466 @@
+/**
+ * @file file.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Bulk file transfer and output implementation
+ * 
+ * @details With --file the sender maps the file and queues packets that point into the mapping, so binary data is sent
+ * as it is and without parsing lines. With --output the receiver writes the delivered payloads into a mapped output file
+ * instead of the standard output. Both programs use these for either direction. Data arrives in order, so it is appended.
+ * The file belongs to one connection, the first one of the server, and the other connections deliver to the standard output.
+ * Without --output the delivered payloads are copied into a buffer, which is written to the standard output with one
+ * writev call when it fills up or when its oldest byte has waited --flush-delay microseconds.
+ * The flush thread swaps in a second buffer before it writes, so a slow reader of the standard output only stops the
+ * receiver when both are full. Their free space, divided between the connections that share them, is the receive window
+ * advertised with the acks. Every shard of the server has its own buffers and flush thread.
+ * 
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "log.h"
+#include "options.h"
+
+/**
+ * @struct output_file
+ * 
+ * @brief Mapped output file. It grows by OUTPUT_CHUNK and is cut to the written size at exit.
+ * 
+ */
+struct output_file {
+	int fd;
+	char *map;
+	/** Mapped and written bytes */
+	size_t mapped;
+	size_t offset;
+	/** The receiver writes while close_output may run at exit */
+	pthread_mutex_t mutex;
+	/** Set when a connection took the file */
+	atomic_int claimed;
+};
+
+static struct output_file output = { .fd = -1,
+				     .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/** Delivery buffers, written at exit */
+static struct delivery_buffer *delivery_buffers = 0;
+/** Keeps the writes of the flush threads whole, a write to a full pipe may be split */
+static pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Maps the given file for reading. Returns -1 on error.
+ * 
+ * @param path 
+ * @param file 
+ * @return int 
+ */
+int map_file(const char *path, struct mapped_file *file)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	file->size = st.st_size;
+	file->data = 0;
+	/** An empty file has nothing to map */
+	if (file->size) {
+		void *map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		/** The pages are read in order once */
+		madvise(map, file->size, MADV_SEQUENTIAL);
+		file->data = map;
+	}
+
+	/** The mapping stays valid after the descriptor is closed */
+	close(fd);
+	return 0;
+}
+
+/**
+ * @brief Queues the given file as packets of up to segment bytes that point into its mapping.
+ * 
+ * @details The packets that fit the send buffer of the queue are queued at once, then wake is called to start the sender
+ * and the function waits for the acks to make space. Returns when the last packet is queued.
+ * 
+ * @param queue 
+ * @param file 
+ * @param segment 
+ * @param wake Wakes up the sender of the queue
+ * @param args Argument of wake
+ */
+void queue_file(struct packet_queue *queue, struct mapped_file *file,
+		unsigned short segment, void (*wake)(void *), void *args)
+{
+	size_t offset = 0;
+	while (offset < file->size) {
+		int space = wait_queue_space(queue);
+		for (; space > 0 && offset < file->size; space--) {
+			struct packet_data header;
+			header.is_ack = 0;
+			header.init_conn = 0;
+			header.terminate_conn = 0;
+			header.len = file->size - offset < segment ?
+					     file->size - offset :
+					     segment;
+			add_mapped_packet(queue, &header, file->data + offset);
+			offset += header.len;
+		}
+		wake(args);
+	}
+}
+
+/**
+ * @brief Waits until every packet in the given queue is acked
+ * 
+ * @param queue 
+ */
+void wait_queue_empty(struct packet_queue *queue)
+{
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->size)
+		pthread_cond_wait(&queue->drained, &queue->mutex);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @brief Unmaps the output file and cuts it to the written size. Registered with atexit.
+ * 
+ */
+static void close_output(void)
+{
+	pthread_mutex_lock(&output.mutex);
+	if (output.fd != -1) {
+		munmap(output.map, output.mapped);
+		if (ftruncate(output.fd, output.offset) == -1)
+			log_print(ERROR, "Cannot truncate the output file");
+		close(output.fd);
+		output.fd = -1;
+	}
+	pthread_mutex_unlock(&output.mutex);
+}
+
+/**
+ * @brief Opens the given output file, the received data is written there instead of the standard output. Returns -1 on error.
+ * 
+ * @param path 
+ * @return int 
+ */
+int open_output(const char *path)
+{
+	if ((output.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+		return -1;
+
+	if (ftruncate(output.fd, OUTPUT_CHUNK) == -1 ||
+	    (output.map = mmap(NULL, OUTPUT_CHUNK, PROT_READ | PROT_WRITE,
+			       MAP_SHARED, output.fd, 0)) == MAP_FAILED) {
+		close(output.fd);
+		output.fd = -1;
+		return -1;
+	}
+
+	output.mapped = OUTPUT_CHUNK;
+	output.offset = 0;
+	atexit(close_output);
+	return 0;
+}
+
+/**
+ * @brief Returns 1 for the first connection that asks for the output file, which then writes its data there.
+ * Returns 0 for the others and without --output, their data goes to the standard output.
+ * 
+ * @return int 
+ */
+int claim_output(void)
+{
+	return output.fd != -1 && !atomic_exchange(&output.claimed, 1);
+}
+
+/**
+ * @brief Writes the given buffers to the standard output, continuing after partial writes
+ * 
+ * @param iov 
+ * @param count 
+ */
+static void write_all(struct iovec *iov, int count)
+{
+	while (count) {
+		ssize_t written = writev(STDOUT_FILENO, iov, count);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			log_print(ERROR, "Cannot write the output");
+		}
+		/** Skip the written buffers and the written part of the next one */
+		for (; count && written >= iov->iov_len; count--, iov++)
+			written -= iov->iov_len;
+		if (count) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+/**
+ * @brief Publishes the free bytes of the given delivery buffers, spare counts while it is not being written.
+ * Buffer mutex must be held.
+ * 
+ * @param buffer 
+ */
+static void publish_room(struct delivery_buffer *buffer)
+{
+	size_t room = DELIVERY_BUFFER_SIZE - buffer->len;
+	if (!buffer->writing)
+		room += DELIVERY_BUFFER_SIZE;
+	atomic_store_explicit(&buffer->room, room, memory_order_relaxed);
+}
+
+/**
+ * @brief Flush thread. Swaps the delivery buffers when the deadline passes or the buffer is full, and writes the full one.
+ * 
+ * @param args Delivery buffer
+ * @return void* 
+ */
+static void *delivery_thread(void *args)
+{
+	struct delivery_buffer *buffer = (struct delivery_buffer *)args;
+
+	pthread_mutex_lock(&buffer->mutex);
+	while (1) {
+		if (!buffer->len) {
+			pthread_cond_wait(&buffer->cond, &buffer->mutex);
+			continue;
+		}
+
+		uint64_t now = now_us();
+		if (buffer->deadline > now) {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			uint64_t wait = buffer->deadline - now;
+			ts.tv_sec += wait / 1000000;
+			ts.tv_nsec += (wait % 1000000) * 1000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&buffer->cond, &buffer->mutex,
+					       &ts);
+			continue;
+		}
+
+		/** The receivers fill the other buffer while this one is written */
+		struct iovec iov = { buffer->data, buffer->len };
+		buffer->data = buffer->spare;
+		buffer->spare = iov.iov_base;
+		buffer->len = 0;
+		buffer->writing = 1;
+		publish_room(buffer);
+		pthread_cond_broadcast(&buffer->space);
+		pthread_mutex_unlock(&buffer->mutex);
+
+		pthread_mutex_lock(&stdout_mutex);
+		write_all(&iov, 1);
+		pthread_mutex_unlock(&stdout_mutex);
+
+		pthread_mutex_lock(&buffer->mutex);
+		buffer->writing = 0;
+		publish_room(buffer);
+		pthread_cond_broadcast(&buffer->space);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Writes what is left in the delivery buffers. Registered with atexit.
+ * 
+ */
+static void close_delivery(void)
+{
+	for (struct delivery_buffer *buffer = delivery_buffers; buffer;
+	     buffer = buffer->next) {
+		pthread_mutex_lock(&buffer->mutex);
+		/** The buffer being written holds the older data */
+		while (buffer->writing)
+			pthread_cond_wait(&buffer->space, &buffer->mutex);
+		if (buffer->len) {
+			struct iovec iov = { buffer->data, buffer->len };
+			pthread_mutex_lock(&stdout_mutex);
+			write_all(&iov, 1);
+			pthread_mutex_unlock(&stdout_mutex);
+			buffer->len = 0;
+		}
+		pthread_mutex_unlock(&buffer->mutex);
+	}
+}
+
+/**
+ * @brief Initializes the given delivery buffer and starts its flush thread. Called before the receivers start.
+ * 
+ * @param buffer 
+ */
+void init_delivery(struct delivery_buffer *buffer)
+{
+	buffer->data = malloc(DELIVERY_BUFFER_SIZE);
+	buffer->spare = malloc(DELIVERY_BUFFER_SIZE);
+	buffer->len = 0;
+	buffer->writing = 0;
+	buffer->deadline = 0;
+	atomic_init(&buffer->room, 2 * DELIVERY_BUFFER_SIZE);
+	atomic_init(&buffer->users, 0);
+	pthread_mutex_init(&buffer->mutex, NULL);
+	pthread_cond_init(&buffer->space, NULL);
+
+	/** The flush thread waits for the deadlines on the monotonic clock */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&buffer->cond, &attr);
+
+	if (!delivery_buffers)
+		atexit(close_delivery);
+	buffer->next = delivery_buffers;
+	delivery_buffers = buffer;
+
+	/** Without a delay the data is written as it is delivered */
+	pthread_t thread;
+	if (options.flush_delay &&
+	    !pthread_create(&thread, 0, &delivery_thread, buffer))
+		pthread_detach(thread);
+}
+
+/**
+ * @brief Counts a connection that delivers to the given buffer
+ * 
+ * @param buffer 
+ */
+void attach_delivery(struct delivery_buffer *buffer)
+{
+	atomic_fetch_add_explicit(&buffer->users, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Uncounts a closed connection of the given buffer
+ * 
+ * @param buffer 
+ */
+void detach_delivery(struct delivery_buffer *buffer)
+{
+	atomic_fetch_sub_explicit(&buffer->users, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds the given received data to the delivery buffer, which is written when it fills up or its deadline passes
+ * 
+ * @details Data that does not fit waits for the flush thread to swap the buffers. That only takes long if the reader of
+ * the standard output is slower than the peer, which the receive window keeps from happening.
+ * 
+ * @param buffer 
+ * @param data 
+ * @param len 
+ */
+static void deliver(struct delivery_buffer *buffer, const char *data,
+		    size_t len)
+{
+	/** Without a delay every delivered packet is written right away. The shards do not serialize these writes,
+	 * the data of different connections is mixed on the standard output anyway, and a packet of up to PIPE_BUF
+	 * bytes goes into a pipe whole. */
+	if (!options.flush_delay) {
+		struct iovec iov = { (void *)data, len };
+		write_all(&iov, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&buffer->mutex);
+	while (buffer->len + len > DELIVERY_BUFFER_SIZE) {
+		buffer->deadline = 0;
+		pthread_cond_signal(&buffer->cond);
+		pthread_cond_wait(&buffer->space, &buffer->mutex);
+	}
+	if (!buffer->len) {
+		buffer->deadline = now_us() + options.flush_delay;
+		pthread_cond_signal(&buffer->cond);
+	}
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+	publish_room(buffer);
+	pthread_mutex_unlock(&buffer->mutex);
+}
+
+/**
+ * @brief Returns the receive window in packets of the given segment size for a connection of the given buffer,
+ * advertised with the acks.
+ * 
+ * @details It is the share of the connection of the room left in the delivery buffers, at most the configured window,
+ * so the connections of a shard together are not offered more than the room. The output file (a NULL buffer) and
+ * the unbuffered standard output take any amount of data, for them it is always the configured window.
+ * 
+ * @param buffer 
+ * @param segment 
+ * @return unsigned int 
+ */
+unsigned int receive_window(struct delivery_buffer *buffer,
+			    unsigned short segment)
+{
+	if (!buffer || !options.flush_delay || !segment)
+		return options.window;
+
+	/** The acks read it for every packet, so it is not behind the buffer mutex */
+	size_t room = atomic_load_explicit(&buffer->room, memory_order_relaxed);
+	int users = atomic_load_explicit(&buffer->users, memory_order_relaxed);
+	if (users > 1)
+		room /= users;
+
+	return room / segment < options.window ? room / segment :
+						  options.window;
+}
+
+/**
+ * @brief Writes the given received data to the output file after the previous data, or to the standard output
+ * through the given delivery buffer
+ * 
+ * @param buffer NULL for the connection that claimed the output file
+ * @param data 
+ * @param len 
+ */
+void write_output(struct delivery_buffer *buffer, const char *data,
+		  size_t len)
+{
+	if (buffer) {
+		deliver(buffer, data, len);
+		return;
+	}
+
+	pthread_mutex_lock(&output.mutex);
+	/** Grow the file and its mapping when the data does not fit */
+	if (output.offset + len > output.mapped) {
+		size_t size = output.mapped + OUTPUT_CHUNK;
+		void *map;
+		if (ftruncate(output.fd, size) == -1 ||
+		    (map = mremap(output.map, output.mapped, size,
+				  MREMAP_MAYMOVE)) == MAP_FAILED) {
+			pthread_mutex_unlock(&output.mutex);
+			log_print(ERROR, "Cannot grow the output file");
+		}
+		output.map = map;
+		output.mapped = size;
+	}
+	memcpy(output.map + output.offset, data, len);
+	output.offset += len;
+	pthread_mutex_unlock(&output.mutex);
+}
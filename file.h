@@ -0,0 +1,78 @@
+/**
+ * @file file.h
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Bulk file transfer and output interface.
+ * 
+ */
+
+#ifndef __FILE_TRANSFER__
+#define __FILE_TRANSFER__
+
+#include <stdatomic.h>
+
+#include "conn.h"
+
+/** Bytes the output file grows by when its mapping is full */
+#define OUTPUT_CHUNK (64 << 20)
+/** Bytes buffered for the standard output before they are written with one call. Two buffers are used in turn. */
+#define DELIVERY_BUFFER_SIZE (256 << 10)
+/** Default time in microseconds a delivered byte waits in the buffer */
+#define DELIVERY_DELAY 1000
+
+/**
+ * @struct mapped_file
+ * 
+ * @brief A file sent with --file. Its pages are mapped and sent from the mapping without copying them into the queue.
+ * 
+ */
+struct mapped_file {
+	const char *data;
+	size_t size;
+};
+
+/**
+ * @struct delivery_buffer
+ * 
+ * @brief Delivered data waiting to be written to the standard output
+ * 
+ * @details The receivers fill data while the flush thread writes spare without the lock, then the two are swapped again.
+ * The client has one, the server one per shard, so the shards do not share a lock on the receive path.
+ * 
+ */
+struct delivery_buffer {
+	char *data;
+	size_t len;
+	char *spare;
+	/** Set while the flush thread writes spare */
+	char writing;
+	/** Time the buffer must be written by, set when the first byte is added. 0 if it is full. */
+	uint64_t deadline;
+	pthread_mutex_t mutex;
+	/** Signaled when the buffer becomes non-empty or full, waited by the flush thread */
+	pthread_cond_t cond;
+	/** Signaled when the buffers are swapped or spare is written, waited by the receivers that do not fit */
+	pthread_cond_t space;
+	/** Free bytes of both buffers, published under the mutex and read without it for the receive window */
+	atomic_size_t room;
+	/** Connections delivering here, the room is divided between them */
+	atomic_int users;
+	/** Next buffer, all of them are written at exit */
+	struct delivery_buffer *next;
+};
+
+/** These functions will be explained in file.c */
+int map_file(const char *path, struct mapped_file *file);
+void queue_file(struct packet_queue *queue, struct mapped_file *file,
+		unsigned short segment, void (*wake)(void *), void *args);
+void wait_queue_empty(struct packet_queue *queue);
+int open_output(const char *path);
+int claim_output(void);
+void init_delivery(struct delivery_buffer *buffer);
+void attach_delivery(struct delivery_buffer *buffer);
+void detach_delivery(struct delivery_buffer *buffer);
+void write_output(struct delivery_buffer *buffer, const char *data,
+		  size_t len);
+unsigned int receive_window(struct delivery_buffer *buffer,
+			    unsigned short segment);
+
+#endif // !__FILE_TRANSFER__
@@ -0,0 +1,302 @@
+/**
+ * @file io.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Batched datagram I/O implementation
+ * 
+ */
+
+#include <netinet/in.h>
+
+#include "io.h"
+#include "options.h"
+
+/** The wire header is placed right before the payload, so it is never moved */
+_Static_assert(PACKET_HEADER_SIZE >= WIRE_HEADER_SIZE,
+	       "The wire header must fit before the payload");
+
+/**
+ * @brief Returns where the datagram of the given packet buffer starts, WIRE_HEADER_SIZE bytes before its payload
+ * 
+ * @param packet 
+ * @return unsigned char* 
+ */
+static unsigned char *wire_start(struct packet_data *packet)
+{
+	return (unsigned char *)packet->char_seq - WIRE_HEADER_SIZE;
+}
+
+/**
+ * @brief Allocates the buffers of the given batch for capacity datagrams
+ * 
+ * @param batch 
+ * @param capacity 
+ */
+void io_batch_init(struct io_batch *batch, int capacity)
+{
+	batch->capacity = capacity;
+	batch->count = 0;
+	batch->msgs = calloc(capacity, sizeof(struct mmsghdr));
+	batch->iovs = calloc(IO_VECTORS * capacity, sizeof(struct iovec));
+	batch->packets = calloc(capacity, sizeof(struct packet_data));
+	batch->addrs = calloc(capacity, sizeof(struct sockaddr_storage));
+
+	/** A message has the packet buffer and more vectors for a mapped payload and its trailer */
+	for (int i = 0; i < capacity; i++) {
+		batch->iovs[IO_VECTORS * i].iov_base = wire_start(&batch->packets[i]);
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[IO_VECTORS * i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+	}
+}
+
+/**
+ * @brief Frees the buffers of the given batch
+ * 
+ * @param batch 
+ */
+void io_batch_free(struct io_batch *batch)
+{
+	free(batch->msgs);
+	free(batch->iovs);
+	free(batch->packets);
+	free(batch->addrs);
+	batch->capacity = batch->count = 0;
+}
+
+/**
+ * @brief Waits for datagrams and receives as many as the batch can hold with one call.
+ * 
+ * @details Returns the number of datagrams received, or -1 on error (including the socket timeout).
+ * The i-th datagram is decoded to packets[i], its length on the wire is in msgs[i].msg_len and its source in
+ * addrs[i] with msgs[i].msg_hdr.msg_namelen bytes.
+ * 
+ * @param sockfd 
+ * @param batch 
+ * @return int 
+ */
+int io_recv(int sockfd, struct io_batch *batch)
+{
+	for (int i = 0; i < batch->capacity; i++) {
+		batch->iovs[IO_VECTORS * i].iov_len = WIRE_HEADER_SIZE + MAX_PAYLOAD_SIZE;
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_namelen =
+			sizeof(struct sockaddr_storage);
+	}
+
+	if (batch->capacity == 1) {
+		int bytes = recvfrom(sockfd, wire_start(&batch->packets[0]),
+				     WIRE_HEADER_SIZE + MAX_PAYLOAD_SIZE, 0,
+				     (struct sockaddr *)&batch->addrs[0],
+				     &batch->msgs[0].msg_hdr.msg_namelen);
+		if (bytes == -1)
+			return batch->count = -1;
+
+		batch->msgs[0].msg_len = bytes;
+		batch->count = 1;
+	} else {
+		/** Block for the first datagram only, then take whatever is already queued */
+		batch->count = recvmmsg(sockfd, batch->msgs, batch->capacity,
+					MSG_WAITFORONE, NULL);
+	}
+
+	/** Read the wire headers into the packets. A datagram that is not a valid packet gets length 0. */
+	for (int i = 0; i < batch->count; i++)
+		if (decode_header(wire_start(&batch->packets[i]),
+				  batch->msgs[i].msg_len,
+				  &batch->packets[i]) == -1)
+			batch->msgs[i].msg_len = 0;
+
+	return batch->count;
+}
+
+/**
+ * @brief Sets how long io_recv waits for the first datagram in microseconds, 0 waits forever. Returns -1 on error.
+ * 
+ * @details An io_recv that times out returns -1 with errno set to EAGAIN.
+ * 
+ * @param sockfd 
+ * @param timeout 
+ * @return int 
+ */
+int io_timeout(int sockfd, uint64_t timeout)
+{
+	struct timeval tv;
+	tv.tv_sec = timeout / 1000000;
+	tv.tv_usec = timeout % 1000000;
+	return setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * @brief Asks the kernel to pace the datagrams of the given socket at the given rate in bytes per second. Returns -1 on error.
+ * 
+ * @details Only the fq queueing discipline enforces it, the pacer of the queue spaces the packets either way.
+ * Rates above what 32 bits hold are capped, older kernels only take 32 bits.
+ * 
+ * @param sockfd 
+ * @param rate 
+ * @return int 
+ */
+int io_pacing(int sockfd, uint64_t rate)
+{
+	unsigned int value = rate > UINT32_MAX ? UINT32_MAX : rate;
+	return setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &value,
+			  sizeof(value));
+}
+
+/**
+ * @brief Sends the datagrams waiting in the given batch. Returns the number of bytes sent, or -1 on error.
+ * 
+ * @param sockfd 
+ * @param batch 
+ * @return int 
+ */
+int io_flush(int sockfd, struct io_batch *batch)
+{
+	int bytes = 0;
+	int sent = 0;
+
+	/** The emulated link takes the datagrams one by one, explained in link.c */
+	if (options.link.enabled) {
+		for (; sent < batch->count; sent++) {
+			bytes += batch->msgs[sent].msg_len =
+				link_send(sockfd, &batch->msgs[sent].msg_hdr);
+		}
+		batch->count = 0;
+		return bytes;
+	}
+	while (sent < batch->count) {
+		struct mmsghdr *msg = &batch->msgs[sent];
+		if (batch->capacity == 1) {
+			if ((msg->msg_len = sendmsg(sockfd, &msg->msg_hdr, 0)) ==
+			    -1)
+				return -1;
+			bytes += msg->msg_len;
+			sent++;
+			continue;
+		}
+
+		/** sendmmsg may stop early, continue from the first unsent message */
+		int res = sendmmsg(sockfd, msg, batch->count - sent, 0);
+		if (res == -1)
+			return -1;
+		for (int i = 0; i < res; i++)
+			bytes += msg[i].msg_len;
+		sent += res;
+	}
+
+	batch->count = 0;
+	return bytes;
+}
+
+/**
+ * @brief Encodes the given packet into the batch to be sent to addr. The batch is flushed when it is full.
+ * 
+ * @details Returns 0 if the packet is queued, the flushed byte count if the batch is sent, or -1 on error.
+ * 
+ * @param sockfd 
+ * @param batch 
+ * @param packet 
+ * @param addr 
+ * @param addr_len 
+ * @return int 
+ */
+int io_send(int sockfd, struct io_batch *batch, struct packet_data *packet,
+	    struct sockaddr *addr, socklen_t addr_len)
+{
+	int i = batch->count++;
+	memcpy(batch->packets[i].char_seq, packet->char_seq, packet->len);
+	unsigned char *wire = wire_start(&batch->packets[i]);
+	encode_header(packet, wire);
+	batch->iovs[IO_VECTORS * i].iov_len = wire_size(packet);
+	/** The trailer follows the payload in the packet buffer */
+	if (has_checksum(packet)) {
+		seal_packet(wire, batch->packets[i].char_seq, packet->len,
+			    (unsigned char *)batch->packets[i].char_seq +
+				    packet->len);
+		batch->iovs[IO_VECTORS * i].iov_len += CHECKSUM_SIZE;
+	}
+	batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	memcpy(&batch->addrs[i], addr, addr_len);
+	batch->msgs[i].msg_hdr.msg_namelen = addr_len;
+
+	if (batch->count == batch->capacity)
+		return io_flush(sockfd, batch);
+
+	return 0;
+}
+
+/**
+ * @brief Like io_send, but only the header is encoded into the batch and the payload is sent from the given memory.
+ * 
+ * @details Used for the packets of a mapped file, header->len bytes are gathered from payload by the kernel.
+ * The payload must stay valid until the batch is flushed.
+ * 
+ * @param sockfd 
+ * @param batch 
+ * @param header 
+ * @param payload 
+ * @param addr 
+ * @param addr_len 
+ * @return int 
+ */
+int io_send_mapped(int sockfd, struct io_batch *batch,
+		   struct packet_data *header, const char *payload,
+		   struct sockaddr *addr, socklen_t addr_len)
+{
+	int i = batch->count++;
+	unsigned char *wire = wire_start(&batch->packets[i]);
+	encode_header(header, wire);
+	batch->iovs[IO_VECTORS * i].iov_len = WIRE_HEADER_SIZE;
+	batch->iovs[IO_VECTORS * i + 1].iov_base = (void *)payload;
+	batch->iovs[IO_VECTORS * i + 1].iov_len = header->len;
+	batch->msgs[i].msg_hdr.msg_iovlen = 2;
+	/** The payload of the packet buffer is unused, the trailer is written there */
+	if (has_checksum(header)) {
+		unsigned char *trailer =
+			(unsigned char *)batch->packets[i].char_seq;
+		seal_packet(wire, payload, header->len, trailer);
+		batch->iovs[IO_VECTORS * i + 2].iov_base = trailer;
+		batch->iovs[IO_VECTORS * i + 2].iov_len = CHECKSUM_SIZE;
+		batch->msgs[i].msg_hdr.msg_iovlen = 3;
+	}
+	memcpy(&batch->addrs[i], addr, addr_len);
+	batch->msgs[i].msg_hdr.msg_namelen = addr_len;
+
+	if (batch->count == batch->capacity)
+		return io_flush(sockfd, batch);
+
+	return 0;
+}
+
+/**
+ * @brief Returns the largest payload that fits the path MTU towards the given address.
+ * 
+ * @details The MTU is read from the route of a socket connected to the address. If it cannot be read,
+ * an Ethernet MTU is assumed. The result is at most MAX_PAYLOAD_SIZE, less the checksum trailer with --checksum.
+ * 
+ * @param addr 
+ * @param addr_len 
+ * @return unsigned short 
+ */
+unsigned short path_segment_size(struct sockaddr *addr, socklen_t addr_len)
+{
+	int ipv6 = addr->sa_family == AF_INET6;
+	int mtu = 1500;
+	socklen_t mtu_len = sizeof(mtu);
+
+	int probe = socket(addr->sa_family, SOCK_DGRAM, 0);
+	if (probe == -1 || connect(probe, addr, addr_len) == -1 ||
+	    getsockopt(probe, ipv6 ? IPPROTO_IPV6 : IPPROTO_IP,
+		       ipv6 ? IPV6_MTU : IP_MTU, &mtu, &mtu_len) == -1)
+		mtu = 1500;
+	if (probe != -1)
+		close(probe);
+
+	/** IP and UDP headers. The checksum trailer is in the packet buffer too, after the payload. */
+	int trailer = options.checksum ? CHECKSUM_SIZE : 0;
+	int size = mtu - (ipv6 ? 40 : 20) - 8 - WIRE_HEADER_SIZE - trailer;
+	if (size > MAX_PAYLOAD_SIZE - trailer)
+		size = MAX_PAYLOAD_SIZE - trailer;
+
+	return size < 1 ? 1 : size;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file io.h
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Batched datagram I/O on top of recvmmsg/sendmmsg.
+ * 
+ */
+
+#ifndef __IO__
+#define __IO__
+
+#include "conn.h"
+
+/** Default and maximum number of datagrams moved with one system call */
+#define IO_BATCH_SIZE 32
+#define IO_BATCH_MAX 1024
+
+/** I/O vectors per message: the packet buffer, a mapped payload and its checksum trailer */
+#define IO_VECTORS 3
+
+/**
+ * @struct io_batch
+ * 
+ * @brief A set of datagrams received or to be sent with one system call.
+ * 
+ * @details Every message has its own packet buffer and address, so the batch owns the data,
+ * except the payloads of mapped packets which are gathered from the second I/O vector of the message.
+ * Their checksum trailer is written to the unused payload of the packet buffer and sent from the third one.
+ * With capacity 1 the batch falls back to recvfrom/sendto.
+ * 
+ */
+struct io_batch {
+	/** Maximum and current number of datagrams */
+	int capacity;
+	int count;
+	/** Message headers and their buffers */
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct packet_data *packets;
+	struct sockaddr_storage *addrs;
+};
+
+/** These functions will be explained in io.c */
+void io_batch_init(struct io_batch *batch, int capacity);
+void io_batch_free(struct io_batch *batch);
+int io_recv(int sockfd, struct io_batch *batch);
+int io_timeout(int sockfd, uint64_t timeout);
+int io_pacing(int sockfd, uint64_t rate);
+int io_send(int sockfd, struct io_batch *batch, struct packet_data *packet,
+	    struct sockaddr *addr, socklen_t addr_len);
+int io_send_mapped(int sockfd, struct io_batch *batch,
+		   struct packet_data *header, const char *payload,
+		   struct sockaddr *addr, socklen_t addr_len);
+int io_flush(int sockfd, struct io_batch *batch);
+unsigned short path_segment_size(struct sockaddr *addr, socklen_t addr_len);
+
+#endif // !__IO__
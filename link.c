@@ -0,0 +1,365 @@
+/**
+ * @file link.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Lossy link emulator implementation
+ * 
+ * @details io_flush hands every outgoing datagram to link_send when options.link is enabled.
+ * Each side impairs only what it sends, so running both programs with the same spec impairs both directions.
+ * Datagrams that are not delayed are sent right away, the others wait in a heap ordered by their due time
+ * for the emulator thread, which is started with the first delayed datagram.
+ * 
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link.h"
+#include "options.h"
+
+/**
+ * @struct link_datagram
+ * 
+ * @brief A datagram waiting on the emulated link
+ * 
+ */
+struct link_datagram {
+	uint64_t due;
+	/** Arrival order, keeps the datagrams with the same due time in order */
+	unsigned long order;
+	int sockfd;
+	size_t len;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char data[sizeof(struct packet_data)];
+};
+
+/** Guards the heap, the random number generator and the bandwidth schedule */
+static pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Signaled when a datagram becomes the earliest one */
+static pthread_cond_t link_cond;
+static pthread_once_t link_once = PTHREAD_ONCE_INIT;
+/** Min-heap of the waiting datagrams */
+static struct link_datagram **heap = 0;
+static int heap_count = 0;
+static int heap_capacity = 0;
+static unsigned long link_order = 0;
+/** Random number generator state, seeded from the config on first use */
+static uint64_t rng_state = 0;
+/** Time the link is free again under the bandwidth cap, fractional so high rates are not rounded away */
+static double link_free_at = 0;
+/** Times the datagrams queued for the bandwidth cap finish their transmission, oldest first.
+ * A ring of options.link.queue entries, allocated with the first datagram. */
+static double *backlog = 0;
+static int backlog_head = 0;
+static int backlog_count = 0;
+
+/**
+ * @brief Parses the given link spec into the given config. Returns -1 if it is not valid.
+ * 
+ * @param spec 
+ * @param config 
+ * @return int 
+ */
+int parse_link(const char *spec, struct link_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->seed = 1;
+	config->queue = LINK_QUEUE_LIMIT;
+
+	char *copy = strdup(spec);
+	char *save = 0;
+	for (char *item = strtok_r(copy, ",", &save); item;
+	     item = strtok_r(0, ",", &save)) {
+		char *value = strchr(item, '=');
+		if (!value)
+			goto invalid;
+		*value++ = '\0';
+
+		char *end;
+		double number = strtod(value, &end);
+		if (*value == '\0' || *end != '\0' || number < 0)
+			goto invalid;
+
+		if (!strcmp(item, "loss") && number <= 100)
+			config->loss = number;
+		else if (!strcmp(item, "dup") && number <= 100)
+			config->dup = number;
+		else if (!strcmp(item, "reorder") && number <= 100)
+			config->reorder = number;
+		else if (!strcmp(item, "corrupt") && number <= 100)
+			config->corrupt = number;
+		else if (!strcmp(item, "delay"))
+			config->delay = number;
+		else if (!strcmp(item, "jitter"))
+			config->jitter = number;
+		else if (!strcmp(item, "rate"))
+			config->rate = number;
+		else if (!strcmp(item, "seed"))
+			config->seed = number;
+		else if (!strcmp(item, "queue") && number >= 1)
+			config->queue = number;
+		else
+			goto invalid;
+	}
+	free(copy);
+
+	config->enabled = config->loss || config->dup || config->reorder ||
+			  config->corrupt ||
+			  config->delay || config->jitter || config->rate;
+	return 0;
+
+invalid:
+	free(copy);
+	return -1;
+}
+
+/**
+ * @brief Returns a uniform random number in [0, 1). xorshift64*, link mutex must be held.
+ * 
+ * @return double 
+ */
+static double link_random(void)
+{
+	if (!rng_state)
+		rng_state = options.link.seed * 0x9E3779B97F4A7C15ULL | 1;
+
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / (1ULL << 53));
+}
+
+/**
+ * @brief Returns 1 if the first datagram is due before the second one
+ * 
+ * @param a 
+ * @param b 
+ * @return int 
+ */
+static int link_before(struct link_datagram *a, struct link_datagram *b)
+{
+	return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+/**
+ * @brief Adds the given datagram to the heap. Link mutex must be held.
+ * 
+ * @param datagram 
+ */
+static void heap_push(struct link_datagram *datagram)
+{
+	if (heap_count == heap_capacity) {
+		heap_capacity = heap_capacity ? 2 * heap_capacity : 64;
+		heap = realloc(heap, heap_capacity * sizeof(*heap));
+	}
+	int i = heap_count++;
+	while (i && link_before(datagram, heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = datagram;
+}
+
+/**
+ * @brief Removes and returns the earliest datagram. Link mutex must be held.
+ * 
+ * @return struct link_datagram* 
+ */
+static struct link_datagram *heap_pop(void)
+{
+	struct link_datagram *top = heap[0];
+	struct link_datagram *last = heap[--heap_count];
+	int i = 0;
+	while (2 * i + 1 < heap_count) {
+		int child = 2 * i + 1;
+		if (child + 1 < heap_count &&
+		    link_before(heap[child + 1], heap[child]))
+			child++;
+		if (!link_before(heap[child], last))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (heap_count)
+		heap[i] = last;
+	return top;
+}
+
+/**
+ * @brief Emulator thread. Sends the waiting datagrams when they are due.
+ * 
+ * @param args 
+ * @return void* 
+ */
+static void *link_thread(void *args)
+{
+	pthread_mutex_lock(&link_mutex);
+	while (1) {
+		if (!heap_count) {
+			pthread_cond_wait(&link_cond, &link_mutex);
+			continue;
+		}
+
+		uint64_t now = now_us();
+		if (heap[0]->due > now) {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			uint64_t wait = heap[0]->due - now;
+			ts.tv_sec += wait / 1000000;
+			ts.tv_nsec += (wait % 1000000) * 1000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&link_cond, &link_mutex, &ts);
+			continue;
+		}
+
+		struct link_datagram *datagram = heap_pop();
+		pthread_mutex_unlock(&link_mutex);
+		/** A lost datagram is what the link emulates anyway, send errors are ignored */
+		sendto(datagram->sockfd, datagram->data, datagram->len, 0,
+		       (struct sockaddr *)&datagram->addr, datagram->addr_len);
+		free(datagram);
+		pthread_mutex_lock(&link_mutex);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Creates the condition on the monotonic clock and starts the emulator thread
+ * 
+ */
+static void start_link_thread(void)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&link_cond, &attr);
+
+	pthread_t thread;
+	if (!pthread_create(&thread, 0, &link_thread, 0))
+		pthread_detach(thread);
+}
+
+/**
+ * @brief Reserves the link for a datagram of the given length under the bandwidth cap and returns the time it leaves,
+ * or -1 if the queue of the link is full. Link mutex must be held.
+ * 
+ * @details The queue holds the datagrams that wait for the link or are being transmitted, the ones still in propagation
+ * are not counted. A datagram that finds it full is dropped like at a router, and the link spends no time on it.
+ * 
+ * @param now 
+ * @param len 
+ * @return double 
+ */
+static double link_reserve(double now, size_t len)
+{
+	struct link_config *config = &options.link;
+	if (!backlog)
+		backlog = malloc(config->queue * sizeof(*backlog));
+
+	/** Forget the datagrams that are on the wire already */
+	while (backlog_count && backlog[backlog_head] <= now) {
+		backlog_head = (backlog_head + 1) % config->queue;
+		backlog_count--;
+	}
+	if (backlog_count >= config->queue)
+		return -1;
+
+	double departure = link_free_at > now ? link_free_at : now;
+	link_free_at = departure + len * 8 / config->rate;
+	backlog[(backlog_head + backlog_count++) % config->queue] = link_free_at;
+	return departure;
+}
+
+/**
+ * @brief Puts a copy of the given datagram on the link, due at the given time. A corrupted copy has one random bit flipped.
+ * Link mutex must be held.
+ * 
+ * @param due 
+ * @param sockfd 
+ * @param msg 
+ * @param corrupt 
+ */
+static void link_queue(uint64_t due, int sockfd, const struct msghdr *msg,
+		       int corrupt)
+{
+	struct link_datagram *datagram = malloc(sizeof(*datagram));
+	datagram->due = due;
+	datagram->order = link_order++;
+	datagram->sockfd = sockfd;
+	/** Gather the header and a mapped payload into one buffer */
+	datagram->len = 0;
+	for (int i = 0; i < msg->msg_iovlen; i++) {
+		memcpy(datagram->data + datagram->len, msg->msg_iov[i].iov_base,
+		       msg->msg_iov[i].iov_len);
+		datagram->len += msg->msg_iov[i].iov_len;
+	}
+	if (corrupt && datagram->len)
+		datagram->data[(size_t)(link_random() * datagram->len)] ^=
+			1 << (int)(link_random() * 8);
+	memcpy(&datagram->addr, msg->msg_name, msg->msg_namelen);
+	datagram->addr_len = msg->msg_namelen;
+	heap_push(datagram);
+	if (heap[0] == datagram)
+		pthread_cond_signal(&link_cond);
+}
+
+/**
+ * @brief Sends the given datagram through the emulated link. Returns its length, a dropped datagram is sent as far as the sender knows.
+ * 
+ * @details The datagram is dropped with the loss probability. Under the bandwidth cap it leaves when the link is free,
+ * or is dropped if the queue of the link is full, see link_reserve.
+ * Then it is delayed by delay plus a uniform jitter, and a reordered one is held back by LINK_REORDER_DELAY more.
+ * A duplicated datagram is sent twice with independent delays and corruptions.
+ * 
+ * @param sockfd 
+ * @param msg 
+ * @return int 
+ */
+int link_send(int sockfd, const struct msghdr *msg)
+{
+	struct link_config *config = &options.link;
+	size_t len = 0;
+	for (int i = 0; i < msg->msg_iovlen; i++)
+		len += msg->msg_iov[i].iov_len;
+	uint64_t due[2] = { 0, 0 };
+	int corrupt[2] = { 0, 0 };
+	int copies = 0;
+
+	pthread_mutex_lock(&link_mutex);
+	double departure = now_us();
+	if (link_random() * 100 >= config->loss &&
+	    (!config->rate || (departure = link_reserve(departure, len)) >= 0)) {
+		copies = link_random() * 100 < config->dup ? 2 : 1;
+
+		for (int i = 0; i < copies; i++) {
+			due[i] = departure + config->delay;
+			if (config->jitter)
+				due[i] += link_random() * config->jitter;
+			if (link_random() * 100 < config->reorder)
+				due[i] += LINK_REORDER_DELAY;
+			corrupt[i] = link_random() * 100 < config->corrupt;
+		}
+	}
+
+	/** Datagrams that are due now and do not overtake a waiting one are sent right away, a corrupted one is copied first */
+	int direct = 0;
+	for (int i = 0; i < copies; i++) {
+		if (due[i] <= now_us() && !heap_count && !corrupt[i]) {
+			direct++;
+			continue;
+		}
+		pthread_once(&link_once, &start_link_thread);
+		link_queue(due[i], sockfd, msg, corrupt[i]);
+	}
+	pthread_mutex_unlock(&link_mutex);
+
+	for (int i = 0; i < direct; i++)
+		sendmsg(sockfd, msg, 0);
+
+	return len;
+}
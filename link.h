@@ -0,0 +1,49 @@
+/**
+ * @file link.h
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Lossy link emulator interface.
+ * 
+ */
+
+#ifndef __LINK__
+#define __LINK__
+
+#include <sys/socket.h>
+
+/** Datagrams the emulated link can queue for the bandwidth cap, the ones arriving at a full queue are dropped */
+#define LINK_QUEUE_LIMIT 1000
+/** Extra delay of a reordered datagram in microseconds, the datagrams after it overtake it */
+#define LINK_REORDER_DELAY 1000
+
+/**
+ * @struct link_config
+ * 
+ * @brief Impairments applied to the datagrams a program sends, read from --link or the EMULATED_LINK environment variable.
+ * 
+ * @details The spec is a comma separated list, e.g. loss=5,delay=10000,jitter=2000,dup=1,reorder=1,corrupt=1,rate=100,seed=7.
+ * loss, dup, reorder and corrupt are percentages, delay and jitter are in microseconds, rate is in Mbit/s.
+ * A corrupted datagram has one random bit flipped.
+ * A delayed datagram is sent by the emulator thread when it is due. Decisions come from a seeded random number generator,
+ * so the same seed gives the same impairments for the same sequence of datagrams.
+ * 
+ */
+struct link_config {
+	/** Set if any impairment is configured */
+	char enabled;
+	double loss;
+	double dup;
+	double reorder;
+	double corrupt;
+	long delay;
+	long jitter;
+	double rate;
+	unsigned long seed;
+	/** Datagrams waiting for or in transmission under the bandwidth cap, the ones in propagation are not counted */
+	int queue;
+};
+
+/** These functions will be explained in link.c */
+int parse_link(const char *spec, struct link_config *config);
+int link_send(int sockfd, const struct msghdr *msg);
+
+#endif // !__LINK__
@@ -0,0 +1,239 @@
+/**
+ * @file lock_bench.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Lock contention benchmark of the send queues, used by make lockbench.
+ * 
+ * @details Runs the given numbers of connections in process like a server shard in the thread core: every connection has
+ * a sender thread that keeps its queue full and sends its window to a loopback socket nobody reads, and one receiver thread
+ * acks the sent packets of all connections in turn, waking their senders up. Each run is done twice:
+ * with "shard", one lock shared by the connections is held around every send and ack, like the shard mutex used to be,
+ * and with "connection", only the queue lock of the connection is taken.
+ * Prints one JSON line per run with the acks and packets per second and the latency of the ack calls in nanoseconds, lock wait included.
+ * 
+ * Usage: lock_benchmark [-s seconds] [connections...]
+ * 
+ */
+
+#include <getopt.h>
+#include <stdatomic.h>
+
+#include "conn.h"
+#include "io.h"
+#include "options.h"
+
+/** Seconds each run takes by default */
+#define LOCK_BENCH_SECONDS 1
+/** Payload of the queued packets */
+#define LOCK_BENCH_PAYLOAD 1000
+/** Ack latencies kept for the percentiles, the later ones are only counted */
+#define LOCK_BENCH_SAMPLES (1 << 20)
+
+/**
+ * @struct bench_conn
+ * 
+ * @brief A connection of the benchmark and the sender thread that sends its window
+ * 
+ */
+struct bench_conn {
+	struct packet_queue queue;
+	/** Last sequence number sent, published by the sender for the receiver */
+	atomic_uint sent;
+	/** Last sequence number acked by the receiver */
+	unsigned int acked;
+	/** Signaled by the receiver when the window slid, the sender waits for it */
+	struct wakeup wakeup;
+	pthread_t thread_id;
+};
+
+/** Lock held around every send and ack in the "shard" runs, 0 in the "connection" runs */
+static pthread_mutex_t *shared_lock;
+static pthread_mutex_t shard_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Socket the windows are sent from and the address of the socket they are sent to */
+static int sockfd;
+static struct sockaddr_storage sink_addr;
+static socklen_t sink_addr_len = sizeof(sink_addr);
+/** Set to stop the threads of a run */
+static atomic_int stop;
+
+/**
+ * @brief Returns the monotonic time in nanoseconds
+ * 
+ * @return uint64_t 
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Sender thread of a connection. Tops the queue up, sends the window and waits for an ack, until the run stops.
+ * 
+ * @param args 
+ * @return void* 
+ */
+static void *send_loop(void *args)
+{
+	struct bench_conn *conn = args;
+	struct io_batch tx;
+	io_batch_init(&tx, options.batch_size);
+
+	struct packet_data data;
+	memset(&data, 'x', sizeof(data));
+	data.is_ack = data.init_conn = data.terminate_conn = 0;
+	data.len = LOCK_BENCH_PAYLOAD;
+
+	while (!atomic_load(&stop)) {
+		while (conn->queue.size < WINDOW_SIZE)
+			add_packet(&conn->queue, &data);
+
+		uint64_t deadline;
+		if (shared_lock)
+			pthread_mutex_lock(shared_lock);
+		pthread_mutex_lock(&conn->queue.mutex);
+		if (send_window(&conn->queue, options.mode, sockfd, &tx,
+				(struct sockaddr *)&sink_addr, sink_addr_len,
+				&deadline) == -1)
+			log_print(ERROR, "Cannot send packet");
+		atomic_store(&conn->sent, conn->queue.last_sent);
+		pthread_mutex_unlock(&conn->queue.mutex);
+		if (shared_lock)
+			pthread_mutex_unlock(shared_lock);
+
+		/** Wait for the ack, a run that stops meanwhile wakes the sender up by the timeout */
+		wakeup_wait(&conn->wakeup, now_us() + 1000);
+	}
+
+	io_batch_free(&tx);
+	return 0;
+}
+
+/**
+ * @brief Compares the given latencies, used to sort them
+ * 
+ * @param a 
+ * @param b 
+ * @return int 
+ */
+static int compare_latency(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Runs the given number of connections for the given time with the given lock mode and prints the result
+ * 
+ * @param count 
+ * @param seconds 
+ * @param mode 
+ */
+static void run(int count, double seconds, const char *mode)
+{
+	struct bench_conn *conns = calloc(count, sizeof(struct bench_conn));
+	uint64_t *samples = malloc(LOCK_BENCH_SAMPLES * sizeof(uint64_t));
+	uint64_t acks = 0;
+
+	atomic_store(&stop, 0);
+	for (int i = 0; i < count; i++) {
+		init_queue(&conns[i].queue);
+		pthread_create(&conns[i].thread_id, 0, &send_loop, &conns[i]);
+	}
+
+	/** The receiver acks the sent packets of the connections in turn, ACK_EVERY of them per cumulative ack like a receiver
+	 * that delays its acks, and wakes the sender up after every ack */
+	uint64_t start = now_ns(), end = start + seconds * 1e9;
+	while (now_ns() < end) {
+		for (int i = 0; i < count; i++) {
+			struct bench_conn *conn = &conns[i];
+			unsigned int sent = atomic_load(&conn->sent);
+			if (sent == conn->acked)
+				continue;
+			unsigned int seq_num = sent - conn->acked > ACK_EVERY ?
+						       conn->acked + ACK_EVERY :
+						       sent;
+
+			uint64_t t0 = now_ns();
+			if (shared_lock)
+				pthread_mutex_lock(shared_lock);
+			int res = acknowledge_packet(&conn->queue, seq_num, -1);
+			if (shared_lock)
+				pthread_mutex_unlock(shared_lock);
+			if (acks < LOCK_BENCH_SAMPLES)
+				samples[acks] = now_ns() - t0;
+			acks++;
+			if (res == -1)
+				continue;
+
+			conn->acked = seq_num;
+			wakeup_signal(&conn->wakeup);
+		}
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	atomic_store(&stop, 1);
+	uint64_t packets = 0;
+	for (int i = 0; i < count; i++) {
+		pthread_join(conns[i].thread_id, 0);
+		packets += stat_get(conns[i].queue.stats.packets);
+		destroy_queue(&conns[i].queue);
+	}
+
+	uint64_t kept = acks < LOCK_BENCH_SAMPLES ? acks : LOCK_BENCH_SAMPLES;
+	qsort(samples, kept, sizeof(uint64_t), &compare_latency);
+	printf("{\"connections\":%d,\"lock\":\"%s\",\"acks_per_s\":%.0f,\"packets_per_s\":%.0f,"
+	       "\"ack_ns\":{\"p50\":%lu,\"p99\":%lu,\"p999\":%lu}}\n",
+	       count, mode, acks / elapsed, packets / elapsed,
+	       kept ? samples[kept / 2] : 0, kept ? samples[kept * 99 / 100] : 0,
+	       kept ? samples[kept * 999 / 1000] : 0);
+	fflush(stdout);
+
+	free(samples);
+	free(conns);
+}
+
+int main(int argc, char *argv[])
+{
+	double seconds = LOCK_BENCH_SECONDS;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		if (opt != 's' || (seconds = atof(optarg)) <= 0) {
+			fprintf(stderr, "Usage: lock_benchmark [-s seconds] [connections...]\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	/** The windows go to a bound socket that is never read, the kernel drops them once its buffer is full */
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int sink = socket(AF_INET, SOCK_DGRAM, 0);
+	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 || sink == -1 ||
+	    bind(sink, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    getsockname(sink, (struct sockaddr *)&sink_addr, &sink_addr_len) ==
+		    -1) {
+		perror("Cannot create the sockets");
+		return EXIT_FAILURE;
+	}
+
+	static const char *default_counts[] = { "1", "4", "16", "64" };
+	const char **counts = optind < argc ? (const char **)argv + optind :
+					      default_counts;
+	int runs = optind < argc ? argc - optind :
+				   sizeof(default_counts) / sizeof(*default_counts);
+
+	for (int i = 0; i < runs; i++) {
+		int count = atoi(counts[i]);
+		if (count <= 0) {
+			fprintf(stderr, "Usage: lock_benchmark [-s seconds] [connections...]\n");
+			return EXIT_FAILURE;
+		}
+
+		shared_lock = &shard_mutex;
+		run(count, seconds, "shard");
+		shared_lock = 0;
+		run(count, seconds, "connection");
+	}
+
+	return EXIT_SUCCESS;
+}
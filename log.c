@@ -0,0 +1,337 @@
+/**
+ * @file log.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Asynchronous log implementation
+ * 
+ * @details Every thread formats its messages into its own ring and a writer thread prints them.
+ * A ring has one producer and one consumer, so the hot path takes no lock and makes no system call.
+ * The writer sleeps on a futex while the rings are empty, a message into an empty ring wakes it up.
+ * The writer is the only consumer, except the thread that prints an error or exits, which holds the same mutex.
+ * 
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "wake.h"
+
+/**
+ * @struct log_record
+ * 
+ * @brief A formatted message waiting in a ring
+ * 
+ */
+struct log_record {
+	enum log_level level;
+	time_t time;
+	char msg[LOG_MESSAGE_SIZE];
+};
+
+/**
+ * @struct log_ring
+ * 
+ * @brief Messages of one thread. head is advanced by the writer, tail by the thread.
+ * 
+ */
+struct log_ring {
+	struct log_record *records;
+	atomic_uint head;
+	atomic_uint tail;
+	/** Messages lost because the ring was full */
+	atomic_ulong dropped;
+	/** Set when the thread exits, the writer frees the ring after printing it */
+	atomic_int closed;
+	struct log_ring *next;
+};
+
+enum log_level log_threshold = INFO;
+
+/** Guards the ring list and the consumer side of the rings */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings = 0;
+/** Ring of the calling thread, and the key to close it when the thread exits */
+static __thread struct log_ring *local_ring = 0;
+static pthread_key_t ring_key;
+/** Seconds of the current time, updated by the writer so the threads do not ask the kernel.
+ * The writer does not update it while it sleeps, so a message into an empty ring reads the time itself. */
+static atomic_long log_clock;
+/** Signaled when a ring goes non-empty */
+static struct wakeup log_wakeup;
+static pid_t log_pid;
+static int log_running = 0;
+
+static const char *level_names[] = { "TRACE", "DEBUG", "INFO", "ERROR" };
+
+/**
+ * @brief Returns the level with the given name, or -1 if there is none.
+ * 
+ * @param name 
+ * @return int 
+ */
+int parse_log_level(const char *name)
+{
+	const char *names[] = { "trace", "debug", "info", "error" };
+	for (int i = 0; i < sizeof(names) / sizeof(*names); i++)
+		if (!strcmp(name, names[i]))
+			return i;
+
+	return -1;
+}
+
+/**
+ * @brief Appends a log line to the given output buffer
+ * 
+ * @param out 
+ * @param len 
+ * @param size 
+ * @param time 
+ * @param level 
+ * @param msg 
+ * @return size_t New length of the buffer
+ */
+static size_t format_line(char *out, size_t len, size_t size, time_t time,
+			  enum log_level level, const char *msg)
+{
+	/** strftime is called once per second, the writer keeps the last result */
+	static time_t cached_time = -1;
+	static char t[20];
+	if (time != cached_time) {
+		struct tm stm;
+		gmtime_r(&time, &stm);
+		strftime(t, sizeof(t), "%Y-%m-%d %H:%M:%S", &stm);
+		cached_time = time;
+	}
+
+	int n = snprintf(out + len, size - len, "%s PROCESS %d %s: %s\n", t,
+			 log_pid, level_names[level], msg);
+	if (n < 0)
+		return len;
+
+	return len + n < size ? len + n : size - 1;
+}
+
+/**
+ * @brief Prints the waiting messages of every thread. Log mutex must be held.
+ * 
+ * @return int Number of messages printed
+ */
+static int drain_rings(void)
+{
+	char out[65536];
+	size_t len = 0;
+	int printed = 0;
+
+	struct log_ring **link = &rings;
+	while (*link) {
+		struct log_ring *ring = *link;
+		/** Read closed before tail, a thread publishes its last message before it closes */
+		int closed = atomic_load_explicit(&ring->closed,
+						  memory_order_acquire);
+		unsigned int head = atomic_load_explicit(&ring->head,
+							 memory_order_relaxed);
+		unsigned int tail = atomic_load_explicit(&ring->tail,
+							 memory_order_acquire);
+		for (; head != tail; head++, printed++) {
+			/** Leave room for a full line, print the buffer with one call when it is full */
+			if (sizeof(out) - len < LOG_MESSAGE_SIZE + 64) {
+				write(STDERR_FILENO, out, len);
+				len = 0;
+			}
+			struct log_record *rec =
+				&ring->records[head & (LOG_RING_SIZE - 1)];
+			len = format_line(out, len, sizeof(out), rec->time,
+					  rec->level, rec->msg);
+		}
+		atomic_store_explicit(&ring->head, head, memory_order_release);
+
+		unsigned long dropped = atomic_exchange_explicit(
+			&ring->dropped, 0, memory_order_relaxed);
+		if (dropped) {
+			char msg[64];
+			snprintf(msg, sizeof(msg), "%lu log messages dropped",
+				 dropped);
+			len = format_line(out, len, sizeof(out), time(0), INFO,
+					  msg);
+		}
+
+		if (closed) {
+			*link = ring->next;
+			free(ring->records);
+			free(ring);
+		} else {
+			link = &ring->next;
+		}
+	}
+
+	if (len)
+		write(STDERR_FILENO, out, len);
+
+	return printed;
+}
+
+/**
+ * @brief Prints the waiting messages, registered with atexit so nothing is lost when the program exits
+ * 
+ */
+static void log_flush(void)
+{
+	pthread_mutex_lock(&log_mutex);
+	drain_rings();
+	pthread_mutex_unlock(&log_mutex);
+}
+
+/**
+ * @brief Marks the ring of an exiting thread closed
+ * 
+ * @param args 
+ */
+static void close_ring(void *args)
+{
+	struct log_ring *ring = (struct log_ring *)args;
+	atomic_store_explicit(&ring->closed, 1, memory_order_release);
+	wakeup_signal(&log_wakeup);
+}
+
+/**
+ * @brief Writer thread. Updates the cached time and prints the rings, sleeps until a ring goes non-empty when they are empty.
+ * 
+ * @details The writer publishes the heads before it reads the tails again and a thread publishes its tail before it
+ * reads the head, so either the writer sees the message in its next pass or the thread sees the ring was empty and signals.
+ * 
+ * @param args 
+ * @return void* 
+ */
+static void *log_writer(void *args)
+{
+	while (1) {
+		atomic_store_explicit(&log_clock, time(0), memory_order_relaxed);
+
+		pthread_mutex_lock(&log_mutex);
+		int printed = drain_rings();
+		pthread_mutex_unlock(&log_mutex);
+
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!printed)
+			wakeup_wait(&log_wakeup, 0);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Sets the runtime threshold and starts the writer thread. Messages before this call are printed directly.
+ * 
+ * @param threshold 
+ */
+void log_init(enum log_level threshold)
+{
+	log_threshold = threshold;
+	log_pid = getpid();
+	atomic_store(&log_clock, time(0));
+	pthread_key_create(&ring_key, close_ring);
+
+	pthread_t writer;
+	if (pthread_create(&writer, 0, &log_writer, 0))
+		return; /** Keep printing directly */
+	pthread_detach(writer);
+	atexit(log_flush);
+	log_running = 1;
+}
+
+/**
+ * @brief Creates and registers the ring of the calling thread
+ * 
+ * @return struct log_ring* 
+ */
+static struct log_ring *register_ring(void)
+{
+	struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+	ring->records = malloc(LOG_RING_SIZE * sizeof(struct log_record));
+
+	pthread_mutex_lock(&log_mutex);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&log_mutex);
+
+	pthread_setspecific(ring_key, ring);
+	return local_ring = ring;
+}
+
+/**
+ * @brief Prints the given formatted message for a given log level, called by log_print.
+ * 
+ * @details Messages are formatted into the ring of the calling thread with the cached time and printed later by the writer.
+ * If the ring is full, the message is dropped and counted.
+ * For `ERROR` log level, the function prints the waiting messages, then the given message and if the errno is set, the error message, stops the program.
+ * 
+ * @param level 
+ * @param logmsg 
+ * @param ... 
+ */
+void log_write(enum log_level level, const char *logmsg, ...)
+{
+	int err = errno;
+	va_list args;
+	va_start(args, logmsg);
+
+	if (level == ERROR || !log_running) {
+		if (log_running)
+			pthread_mutex_lock(&log_mutex);
+
+		/** Not cut, usage messages are long */
+		char msg[4096];
+		int len = vsnprintf(msg, sizeof(msg), logmsg, args);
+		if (level == ERROR && err && len >= 0 && len < sizeof(msg))
+			snprintf(msg + len, sizeof(msg) - len, "; %s",
+				 strerror(err));
+
+		char out[sizeof(msg) + 64];
+		if (log_running)
+			drain_rings();
+		else
+			log_pid = getpid();
+		size_t n = format_line(out, 0, sizeof(out), time(0), level, msg);
+		write(STDERR_FILENO, out, n);
+
+		if (level == ERROR)
+			_exit(-1);
+		if (log_running)
+			pthread_mutex_unlock(&log_mutex);
+		va_end(args);
+		return;
+	}
+
+	struct log_ring *ring = local_ring ? local_ring : register_ring();
+	unsigned int tail =
+		atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head =
+		atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (tail - head == LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1,
+					  memory_order_relaxed);
+		va_end(args);
+		return;
+	}
+
+	struct log_record *rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+	rec->level = level;
+	if (tail == head) {
+		/** The writer may be asleep with a stale clock */
+		rec->time = time(0);
+		atomic_store_explicit(&log_clock, rec->time,
+				      memory_order_relaxed);
+	} else {
+		rec->time = atomic_load_explicit(&log_clock,
+						 memory_order_relaxed);
+	}
+	vsnprintf(rec->msg, sizeof(rec->msg), logmsg, args);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	/** Wake the writer up if it had printed everything before this message */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ring->head, memory_order_relaxed) == tail)
+		wakeup_signal(&log_wakeup);
+	va_end(args);
+}
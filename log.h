@@ -20,45 +20,42 @@
  * 
  * @brief This enumeration is used to determine the log level
  * 
+ * @details `TRACE` is printed for every packet, `DEBUG` for every window sent and packet out of order,
+ * `INFO` for connection events and `ERROR` stops the program.
+ * 
  */
-enum log_level { LOG, ERROR };
+enum log_level { TRACE, DEBUG, INFO, ERROR };
+
+/** Lowest level compiled in, e.g. make DEFS=-DLOG_MIN_LEVEL=INFO removes the per packet logs */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL TRACE
+#endif
+
+/** Size of a formatted message, longer messages are cut */
+#define LOG_MESSAGE_SIZE 232
+/** Messages a thread can have waiting for the writer, must be a power of two */
+#define LOG_RING_SIZE 4096
+
+/** Lowest level printed, set by log_init */
+extern enum log_level log_threshold;
 
 /**
  * @brief Prints the log level, timestamp, process id and given formatted message for a given log level.
  * 
- * @details For `LOG` log level, the function just prints the given formatted message.
- * For `ERROR` log level, the function print the given message and if the errno is set, prints the error message, stops the program.
+ * @details Levels below LOG_MIN_LEVEL are removed at compile time, levels below the runtime threshold cost a comparison.
+ * Explained in log.c
  * 
- * @param level 
- * @param logmsg 
- * @param ... 
  */
-void log_print(enum log_level level, const char *logmsg, ...)
-{
-	va_list args;
-	va_start(args, logmsg);
-
-	pid_t curr_pid = getpid();
-
-	char t[20];
-	time_t st = time(0);
-	struct tm *stm = gmtime(&st);
-	strftime(t, sizeof(t), "%Y-%m-%d %H:%M:%S", stm);
-
-	switch (level) {
-	case LOG:
-		fprintf(stderr, "%s PROCESS %d LOG: ", t, curr_pid);
-		vfprintf(stderr, logmsg, args);
-		fprintf(stderr, "\n");
-		break;
-	case ERROR:
-		fprintf(stderr, "%s PROCESS %d ERROR: ", t, curr_pid);
-		vfprintf(stderr, logmsg, args);
-		if (errno)
-			fprintf(stderr, "; %s", strerror(errno));
-		fprintf(stderr, "\n");
-		_exit(-1);
-	}
-}
+#define log_print(level, ...)                                             \
+	do {                                                              \
+		if ((level) >= LOG_MIN_LEVEL && (level) >= log_threshold) \
+			log_write((level), __VA_ARGS__);                  \
+	} while (0)
+
+/** These functions will be explained in log.c */
+void log_init(enum log_level threshold);
+void log_write(enum log_level level, const char *logmsg, ...)
+	__attribute__((format(printf, 2, 3)));
+int parse_log_level(const char *name);
 
 #endif // !__LOG__
@@ -0,0 +1,203 @@
+/**
+ * @file options.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Command line option parsing
+ * 
+ */
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+#include "io.h"
+#include "options.h"
+
+/** Options used by both programs, initialized with the defaults */
+struct options options = {
+	.batch_size = IO_BATCH_SIZE,
+	.segment_size = MAX_PAYLOAD_SIZE,
+	.mode = GO_BACK_N,
+	.min_rto = MIN_RTO,
+	.max_rto = MAX_RTO,
+	.cc = &cc_reno,
+	.window = WINDOW_SIZE,
+	.core = CORE_EVENTS,
+	.shards = 1,
+	.log_level = INFO,
+	.flush_delay = DELIVERY_DELAY,
+	.ack_every = ACK_EVERY,
+	.ack_delay = ACK_DELAY,
+	.send_buffer = SEND_BUFFER_SIZE,
+};
+
+/** Codes of the options without a short form */
+enum long_option { OPT_MIN_RTO = 256, OPT_MAX_RTO, OPT_CC, OPT_CORE, OPT_SHARDS,
+		   OPT_LOG_LEVEL, OPT_LINK, OPT_FILE, OPT_OUTPUT,
+		   OPT_FLUSH_DELAY, OPT_ACK_EVERY, OPT_ACK_DELAY,
+		   OPT_CHECKSUM, OPT_PACE, OPT_SEND_BUFFER };
+
+/**
+ * @brief Parses a positive integer option argument between 1 and max. Returns -1 if it is not valid.
+ * 
+ * @param arg 
+ * @param max 
+ * @return int 
+ */
+static int parse_count(const char *arg, long max)
+{
+	char *end;
+	long value = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || value < 1 || value > max)
+		return -1;
+
+	return value;
+}
+
+/**
+ * @brief Fills the global options from the command line.
+ * 
+ * @details Returns the index of the first positional argument, or -1 if an option is not valid.
+ * 
+ * @param argc 
+ * @param argv 
+ * @return int 
+ */
+int parse_options(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "batch", required_argument, 0, 'b' },
+		{ "segment", required_argument, 0, 's' },
+		{ "mode", required_argument, 0, 'm' },
+		{ "rto-min", required_argument, 0, OPT_MIN_RTO },
+		{ "rto-max", required_argument, 0, OPT_MAX_RTO },
+		{ "window", required_argument, 0, 'w' },
+		{ "cc", required_argument, 0, OPT_CC },
+		{ "core", required_argument, 0, OPT_CORE },
+		{ "shards", required_argument, 0, OPT_SHARDS },
+		{ "log-level", required_argument, 0, OPT_LOG_LEVEL },
+		{ "link", required_argument, 0, OPT_LINK },
+		{ "file", required_argument, 0, OPT_FILE },
+		{ "output", required_argument, 0, OPT_OUTPUT },
+		{ "flush-delay", required_argument, 0, OPT_FLUSH_DELAY },
+		{ "ack-every", required_argument, 0, OPT_ACK_EVERY },
+		{ "ack-delay", required_argument, 0, OPT_ACK_DELAY },
+		{ "checksum", no_argument, 0, OPT_CHECKSUM },
+		{ "pace", required_argument, 0, OPT_PACE },
+		{ "send-buffer", required_argument, 0, OPT_SEND_BUFFER },
+		{ 0, 0, 0, 0 },
+	};
+
+	/** The link can be impaired without changing the command line, --link overrides it */
+	char *link = getenv(LINK_ENV);
+	if (link && parse_link(link, &options.link) == -1)
+		return -1;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "b:s:m:w:", long_options, 0)) != -1) {
+		switch (opt) {
+		case 'b':
+			if ((options.batch_size =
+				     parse_count(optarg, IO_BATCH_MAX)) == -1)
+				return -1;
+			break;
+		case 's':
+			if ((options.segment_size =
+				     parse_count(optarg, MAX_PAYLOAD_SIZE)) == -1)
+				return -1;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "gbn"))
+				options.mode = GO_BACK_N;
+			else if (!strcmp(optarg, "sr"))
+				options.mode = SELECTIVE_REPEAT;
+			else
+				return -1;
+			break;
+		case OPT_MIN_RTO:
+			if ((options.min_rto = parse_count(optarg, 60000000)) == -1)
+				return -1;
+			break;
+		case OPT_MAX_RTO:
+			if ((options.max_rto = parse_count(optarg, 60000000)) == -1)
+				return -1;
+			break;
+		case 'w':
+			if ((options.window = parse_count(optarg, MAX_WINDOW_SIZE)) ==
+			    -1)
+				return -1;
+			break;
+		case OPT_CC:
+			if (!(options.cc = find_cc(optarg)))
+				return -1;
+			break;
+		case OPT_CORE:
+			if (!strcmp(optarg, "events"))
+				options.core = CORE_EVENTS;
+			else if (!strcmp(optarg, "threads"))
+				options.core = CORE_THREADS;
+			else
+				return -1;
+			break;
+		case OPT_SHARDS:
+			if ((options.shards = parse_count(optarg, MAX_SHARDS)) == -1)
+				return -1;
+			break;
+		case OPT_LOG_LEVEL:
+			if ((options.log_level = parse_log_level(optarg)) == -1)
+				return -1;
+			break;
+		case OPT_LINK:
+			if (parse_link(optarg, &options.link) == -1)
+				return -1;
+			break;
+		case OPT_FILE:
+			options.file = optarg;
+			break;
+		case OPT_OUTPUT:
+			options.output = optarg;
+			break;
+		case OPT_FLUSH_DELAY:
+			/** 0 is allowed, parse_count starts at 1 */
+			if (!strcmp(optarg, "0"))
+				options.flush_delay = 0;
+			else if ((options.flush_delay =
+					  parse_count(optarg, 60000000)) == -1)
+				return -1;
+			break;
+		case OPT_ACK_EVERY:
+			if ((options.ack_every =
+				     parse_count(optarg, MAX_WINDOW_SIZE)) == -1)
+				return -1;
+			break;
+		case OPT_ACK_DELAY:
+			if (!strcmp(optarg, "0"))
+				options.ack_delay = 0;
+			else if ((options.ack_delay =
+					  parse_count(optarg, 1000000)) == -1)
+				return -1;
+			break;
+		case OPT_CHECKSUM:
+			options.checksum = 1;
+			break;
+		case OPT_PACE:
+			if (!strcmp(optarg, "auto"))
+				options.pacing = PACING_AUTO;
+			else if ((options.pacing = parse_count(optarg, 1000000)) ==
+				 -1)
+				return -1;
+			break;
+		case OPT_SEND_BUFFER:
+			if ((options.send_buffer = parse_count(optarg, 1L << 30)) == -1)
+				return -1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (options.min_rto > options.max_rto)
+		return -1;
+
+	return optind;
+}
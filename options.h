@@ -0,0 +1,102 @@
+/**
+ * @file options.h
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Command line options shared by the server and the client.
+ * 
+ */
+
+#ifndef __OPTIONS__
+#define __OPTIONS__
+
+#include "conn.h"
+#include "link.h"
+#include "log.h"
+
+/**
+ * @enum server_core
+ * 
+ * @brief How the server drives the send windows of its connections, explained in server.c
+ * 
+ */
+enum server_core { CORE_EVENTS, CORE_THREADS };
+
+/**
+ * @struct options
+ * 
+ * @brief Runtime configuration of the transport. Filled with defaults and then from the command line.
+ * 
+ */
+struct options {
+	/** Datagrams moved with one recvmmsg/sendmmsg call. 1 uses recvfrom/sendto. */
+	int batch_size;
+	/** Largest payload this side accepts, the smaller of both sides and the path MTU is used */
+	int segment_size;
+	/** Retransmission scheme, explained in conn.h */
+	enum arq_mode mode;
+	/** Bounds of the retransmission timeout in microseconds */
+	long min_rto;
+	long max_rto;
+	/** Congestion control algorithm, explained in cc.h */
+	const struct cc_ops *cc;
+	/** Receive window in packets, told to the peer with the init packets */
+	int window;
+	/** Server only, event loop or a sender thread per connection */
+	enum server_core core;
+	/** Server only, number of sockets sharing the port, each served by its own thread */
+	int shards;
+	/** Lowest log level printed, explained in log.h */
+	enum log_level log_level;
+	/** Impairments of the emulated link, explained in link.h */
+	struct link_config link;
+	/** File sent in bulk instead of the standard input, and file the received data is written to */
+	const char *file;
+	const char *output;
+	/** Longest time in microseconds delivered data waits before it is written to the standard output */
+	long flush_delay;
+	/** In-order packets acked with one cumulative ack, and the longest time in microseconds an ack is held back */
+	int ack_every;
+	long ack_delay;
+	/** Set if the packets are sent with a CRC32C trailer, explained in crc.c. Received checksums are always verified. */
+	char checksum;
+	/** Pacing rate of every connection in Mbit/s, PACING_AUTO to derive it from the congestion window, 0 sends windows at once */
+	long pacing;
+	/** Bytes of packets the input may queue per connection before it waits for acks */
+	long send_buffer;
+};
+
+/** Environment variable read for the link spec when --link is not given */
+#define LINK_ENV "EMULATED_LINK"
+
+/** Largest number of server shards */
+#define MAX_SHARDS 256
+
+/** Global options, explained in options.c */
+extern struct options options;
+
+/** Option descriptions, printed after the usage line */
+#define OPTIONS_HELP                                                        \
+	"Options:\n"                                                        \
+	"  -b, --batch <n>     datagrams per recvmmsg/sendmmsg call, 1 disables batching\n" \
+	"  -s, --segment <n>   largest payload per packet in bytes\n"         \
+	"  -m, --mode <mode>   gbn (Go-Back-N, default) or sr (Selective Repeat)\n" \
+	"  --rto-min <us>      lower bound of the retransmission timeout\n"     \
+	"  --rto-max <us>      upper bound of the retransmission timeout\n"     \
+	"  -w, --window <n>    receive window in packets\n"                    \
+	"  --cc <name>         congestion control, reno (default) or fixed\n"      \
+	"  --core <name>       server only, events (default) or threads\n"     \
+	"  --shards <n>        server only, receive threads with their own socket\n" \
+	"  --log-level <level> trace, debug, info (default) or error\n"      \
+	"  --link <spec>       emulate a lossy link, e.g. loss=5,delay=10000,jitter=2000,dup=1,reorder=1,corrupt=1,rate=100,seed=7\n" \
+	"                      also read from the " LINK_ENV " environment variable\n" \
+	"  --file <path>       send the given file instead of the standard input\n" \
+	"  --output <path>     write the received data to the given file instead of the standard output\n" \
+	"  --flush-delay <us>  longest time received data is buffered before it is written, 0 writes every packet\n" \
+	"  --ack-every <n>     in-order packets acked with one ack, 1 acks every packet\n" \
+	"  --ack-delay <us>    longest time an ack is held back, 0 sends it after the received batch\n" \
+	"  --checksum          send a CRC32C with every packet, corrupted packets are dropped\n" \
+	"  --pace <rate>       pace the packets of every connection at the given Mbit/s, or auto for the window per round trip\n" \
+	"  --send-buffer <n>   bytes queued per connection before the input waits for acks\n"
+
+int parse_options(int argc, char *argv[]);
+
+#endif // !__OPTIONS__
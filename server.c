@@ -5,51 +5,159 @@
  * 
  */
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
 #include "conn.h"
+#include "file.h"
+#include "io.h"
 #include "log.h"
+#include "options.h"
 
-/** Global variables for socket and active connections */
-/** Socket file descriptor */
-int sockfd = -1;
+/**
+ * @struct shard
+ * 
+ * @brief A socket bound to the server port and the connections whose datagrams arrive on it.
+ * 
+ * @details With more than one shard every socket sets SO_REUSEPORT, so the kernel hashes each client
+ * to one of them, and each shard is served by its own thread. A shard owns its connections outright.
+ * The window of a connection is guarded by the lock of its queue alone, so a connection sending its window
+ * does not hold up the acks or the sends of the others. The shard mutex only guards the ready list.
+ * 
+ */
+struct shard {
+	int id;
+	/** Socket file descriptor */
+	int sockfd;
+	/** Event core: guards the ready list against the input thread */
+	pthread_mutex_t mutex;
+	/** Table to look the connections of this shard up by address */
+	struct connection_table conn_table;
+	/** Event core: epoll instance, the timer of the earliest retransmission and the wakeup of the input thread */
+	int epoll_fd;
+	int timer_fd;
+	int event_fd;
+	/** Event core: connections that have packets to send */
+	struct connection_t *ready_head;
+	struct connection_t *ready_tail;
+	/** Event core: retransmission deadlines of the connections */
+	struct timer_heap timers;
+	/** Data delivered by the connections of this shard, waiting for the standard output */
+	struct delivery_buffer delivery;
+	/** Connections holding back an ack, and the earliest deadline of them, 0 if none */
+	struct connection_t *held_acks;
+	uint64_t ack_deadline;
+	/** Time of the last received datagram, read by the other shards in the termination sequence */
+	uint64_t last_rx;
+	pthread_t thread_id;
+};
+
+/** Global variables for sockets and active connections */
+/** Shards, options.shards of them */
+struct shard *shards = 0;
 /** Num of active connections */
 int active_conn = 0;
 /** Termination variable. When set, shows that the program is in termination sequence */
 char terminate = 0;
 
-/** Global mutex */
+/** Global mutex, guards the connection list and the connection counters */
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 /** Current connection. connection_t explanation in conn.h */
 struct connection_t *curr_conn = 0;
+/** Last connection of the list */
+struct connection_t *last_conn = 0;
+/** Set until the first connection is initiated */
+char first = 1;
+/** Set when the first connection is established, the file of --file is sent to it */
+char established = 0;
+pthread_cond_t established_cond = PTHREAD_COND_INITIALIZER;
+/** File sent with --file */
+struct mapped_file input;
+/** Datagrams that are malformed or do not belong to a connection */
+struct recv_stats unmatched_stats;
 
 /**
- * @brief Wait for signal or timeout
+ * @brief Wait for signal or until the given monotonic deadline in microseconds
  * 
- * @param time 
+ * @param conn 
+ * @param deadline 
  */
-void wait_or_signal(long time)
+void wait_or_signal(struct connection_t *conn, uint64_t deadline)
 {
-	struct timespec ts;
-	clock_gettime(CLOCK_REALTIME, &ts);
+	if (!wakeup_wait(&conn->wakeup, deadline))
+		log_print(DEBUG, "Timed out, sending packages again");
+}
 
-	ts.tv_sec += time / 1000;
-	long ns_left = (time % 1000) * 1000000;
-	long left_limit = 1000000000 - ts.tv_nsec;
+/**
+ * @brief Logs the packet pool counters of the given connection
+ * 
+ * @param conn 
+ */
+void log_pool_stats(struct connection_t *conn)
+{
+	struct pool_stats stats = queue_pool_stats(&conn->queue);
+	log_print(INFO, "Connection %d pool: %lu hits, %lu misses, high water %u",
+		  conn->id, stats.hits, stats.misses, stats.high_water);
+}
 
-	if (ns_left > left_limit) {
-		ts.tv_sec++;
-		ts.tv_nsec = ns_left - left_limit;
-	} else {
-		ts.tv_nsec += ns_left;
+/**
+ * @brief Prints the counters of every connection and their totals as JSON, called by the stats thread on SIGUSR1
+ * 
+ * @param out 
+ */
+void dump_stats(FILE *out)
+{
+	struct send_stats total = { 0 };
+	struct recv_stats total_recv = { 0 };
+
+	/** Hold the global mutex, the shards may add connections meanwhile */
+	pthread_mutex_lock(&mutex);
+	struct connection_t *conn = last_conn;
+	while (conn && conn->prev)
+		conn = conn->prev;
+
+	fprintf(out, "{\"connections\":[");
+	for (; conn; conn = conn->next) {
+		print_stats(out, conn->id, &conn->queue, &conn->recv_stats);
+		fprintf(out, "%s", conn->next ? "," : "");
+		add_stats(&total, &total_recv, &conn->queue.stats,
+			  &conn->recv_stats);
 	}
+	fprintf(out, "],\"active\":%d,\"total\":", active_conn);
+	pthread_mutex_unlock(&mutex);
 
-	pthread_mutex_lock(&curr_conn->timeout_mutex);
-	int res = pthread_cond_timedwait(&curr_conn->timeout_cond,
-					 &curr_conn->timeout_mutex, &ts);
-	if (res == ETIMEDOUT)
-		log_print(LOG, "Timed out, sending packages again");
-	else if (res)
-		log_print(ERROR, "Timed wait error");
-	pthread_mutex_unlock(&curr_conn->timeout_mutex);
+	print_totals(out, &total, &total_recv);
+	fprintf(out, ",\"unmatched\":{\"packets\":%lu,\"bytes\":%lu}}",
+		stat_get(unmatched_stats.packets),
+		stat_get(unmatched_stats.bytes));
+}
+
+/**
+ * @brief Sends the packets in the window of the given connection that are due. The time of the next retransmission is written to deadline.
+ * 
+ * @param conn 
+ * @param tx 
+ * @param deadline 
+ */
+void send_connection(struct connection_t *conn, struct io_batch *tx,
+		     uint64_t *deadline)
+{
+	struct shard *shard = &shards[conn->shard];
+	/** Hold the queue lock, the receiver acks and the input thread adds to the window meanwhile.
+	 * Only this connection waits for it, the other connections of the shard keep acking and sending. */
+	pthread_mutex_lock(&conn->queue.mutex);
+	/** Send the packets in the window that are not sent yet or timed out, explanation in conn.c */
+	int bytes_sent = send_window(&conn->queue, options.mode, shard->sockfd,
+				     tx, (struct sockaddr *)&conn->target_addr,
+				     conn->target_addr_len, deadline);
+	unsigned int window = queue_window(&conn->queue);
+	pthread_mutex_unlock(&conn->queue.mutex);
+	if (bytes_sent == -1)
+		log_print(ERROR, "Cannot send packet");
+	if (bytes_sent)
+		log_print(DEBUG, "Sent %d bytes to client %d, window %u",
+			  bytes_sent, conn->id, window);
 }
 
 /**
@@ -63,55 +171,88 @@ void *send_packets(void *args)
 	/** Get the connection which is associated with this thread */
 	struct connection_t *conn = (struct connection_t *)args;
 
-	log_print(LOG, "Connection thread %d created, waiting for turn",
+	log_print(INFO, "Connection thread %d created, waiting for turn",
 		  conn->id);
 
+	/** Window packets are sent in batches */
+	struct io_batch tx;
+	io_batch_init(&tx, options.batch_size);
+
 	/** Run until the program termination */
 	while (1) {
 		while (conn->queue.size) {
-			int i = 0;
-			/** Get the lock to prevent the synchronization issues with the receiver thread acknowledge */
-			pthread_mutex_lock(&mutex);
-			/** Iterate over the queue until the end or window size */
-			for (struct packet_t *head = conn->queue.head;
-			     head && i < WINDOW_SIZE; head = head->next, i++) {
-				/** Set last sent as the sequence number, this will eventually be equal to the last sent in the window.
-				 * No duplicate sequence numbers occur using this var because all threads using this var is locked.
-				 */
-				conn->queue.last_sent = head->data.seq_num;
-				log_print(
-					LOG,
-					"Thread %d sending the packet %d in queue",
-					conn->id, head->data.seq_num);
-				/** Send packets to server. If there is an error, exit with error message */
-				int bytes_sent = 0;
-				if ((bytes_sent = sendto(
-					     sockfd, &head->data,
-					     sizeof(struct packet_data), 0,
-					     &conn->target_addr,
-					     conn->target_addr_len)) == -1)
-					log_print(ERROR, "Cannot send packet");
-				log_print(LOG, "Sent %d bytes to client %d",
-					  bytes_sent, conn->id);
-			}
-			pthread_mutex_unlock(&mutex);
+			uint64_t deadline;
+			send_connection(conn, &tx, &deadline);
 
-			/** Wait 100ms or or ack signal.
-			 * If continues with a signal, it is guaranteed that some packets are acked and evicted from the queue,
-			 * meaning that the window slided.
+			/** Wait until the next retransmission or a signal.
+			 * If continues with a signal, it is guaranteed that some packets are acked or added,
+			 * meaning that the window slided, a selectively acked packet will not be sent again or new packets may fit.
 			 */
-			wait_or_signal(100);
+			wait_or_signal(conn, deadline);
 		}
 
-		/** If the queue becomes empty, wait packets to be added to the queue */
-		pthread_mutex_lock(&mutex);
-		pthread_cond_wait(&conn->cond, &mutex);
-		pthread_mutex_unlock(&mutex);
+		/** If the queue becomes empty, wait packets to be added to the queue.
+		 * A wakeup signaled after the loop checked the size stays pending, so it is not missed.
+		 */
+		while (!conn->queue.size)
+			wakeup_wait(&conn->wakeup, 0);
 	}
 
 	pthread_exit(EXIT_SUCCESS);
 }
 
+/**
+ * @brief Adds the given connection to the end of the ready list of its shard if it is not there. Shard mutex must be held.
+ * 
+ * @param shard 
+ * @param conn 
+ */
+void mark_ready(struct shard *shard, struct connection_t *conn)
+{
+	if (conn->ready)
+		return;
+
+	conn->ready = 1;
+	conn->next_ready = 0;
+	if (shard->ready_tail)
+		shard->ready_tail->next_ready = conn;
+	else
+		shard->ready_head = conn;
+	shard->ready_tail = conn;
+}
+
+/**
+ * @brief Tells the sender of the given connection that packets are added to its queue.
+ * The sender thread is signaled, or in the event core the connection is marked ready and the event loop woken up.
+ * 
+ * @param conn 
+ */
+void wake_sender(struct connection_t *conn)
+{
+	struct shard *shard = &shards[conn->shard];
+	if (options.core == CORE_EVENTS) {
+		pthread_mutex_lock(&shard->mutex);
+		mark_ready(shard, conn);
+		pthread_mutex_unlock(&shard->mutex);
+	} else {
+		wakeup_signal(&conn->wakeup);
+	}
+
+	if (options.core == CORE_EVENTS &&
+	    eventfd_write(shard->event_fd, 1) == -1)
+		log_print(ERROR, "Cannot wake up the event loop");
+}
+
+/**
+ * @brief Wakes up the sender of the connection given as the argument, called by queue_file
+ * 
+ * @param args 
+ */
+void wake_file_sender(void *args)
+{
+	wake_sender(args);
+}
+
 /**
  * @brief Thread for getting user input. Adds packets to the queue.
  * 
@@ -123,94 +264,700 @@ void *read_input(void *args)
 	char terminate_read = 0;
 	char *line = 0;
 	size_t line_len = 0;
-	/** Run until the program termination 
-	 * Conditions for this thread is to have two or more blank lines or being in the termination sequence
-	 */
-	while (terminate_read < 2 && !terminate) {
-		int num_read = getline(&line, &line_len, stdin);
-		/** Count the number of empty lines */
-		if (!num_read || !strcmp(line, "\n")) {
-			terminate_read++;
-		} else {
-			terminate_read = 0;
-
-			if (!curr_conn) {
-				/** If no connection, ignore */
-				log_print(LOG, "No connections exists");
-				continue;
-			}
+	/** A mapped file is queued in bulk for the first connection and sent to its end before the termination */
+	if (options.file) {
+		/** Packets are segmented with the negotiated size, wait for the connection */
+		pthread_mutex_lock(&mutex);
+		while (!established)
+			pthread_cond_wait(&established_cond, &mutex);
+		struct connection_t *conn = curr_conn;
+		pthread_mutex_unlock(&mutex);
 
-			/** Get the actual line length */
-			line_len = strlen(line);
-			/** Divide the line into packets.
-			 * Iterate over all segments and copy PAYLOAD_SIZE sized data to packet data.
-			 */
-			for (int i = 0; i < line_len; i += PAYLOAD_SIZE) {
-				struct packet_data data;
-				memset(data.char_seq, '\0', PAYLOAD_SIZE);
-				if (i + PAYLOAD_SIZE < line_len)
-					strncpy(data.char_seq, line + i,
-						PAYLOAD_SIZE);
-				else
-					strncpy(data.char_seq, line + i,
-						line_len - i);
-				add_packet(&curr_conn->queue, &data);
-				log_print(LOG, "Adding %s to data", line + i);
-			}
-			if (curr_conn->queue.size >= 1) {
-				/** Send packets arrived signal to the send_packets thread */
-				pthread_mutex_lock(&mutex);
-				pthread_cond_signal(&curr_conn->cond);
-				pthread_mutex_unlock(&mutex);
+		queue_file(&conn->queue, &input, conn->seg_size,
+			   &wake_file_sender, conn);
+		wait_queue_empty(&conn->queue);
+	} else {
+		/** Run until the program termination 
+		 * Conditions for this thread is to have two or more blank lines or being in the termination sequence
+		 */
+		while (terminate_read < 2 && !terminate) {
+			int num_read = getline(&line, &line_len, stdin);
+			/** Count the number of empty lines */
+			if (!num_read || !strcmp(line, "\n")) {
+				terminate_read++;
+			} else {
+				terminate_read = 0;
+
+				if (!curr_conn) {
+					/** If no connection, ignore */
+					log_print(INFO, "No connections exists");
+					continue;
+				}
+
+				/** Get the actual line length */
+				line_len = strlen(line);
+				/** Divide the line into packets.
+				 * Iterate over all segments and copy up to the negotiated segment size of data to packet data.
+				 */
+				unsigned short segment = curr_conn->seg_size;
+				for (int i = 0; i < line_len; i += segment) {
+					struct packet_data data;
+					data.is_ack = 0;
+					data.init_conn = 0;
+					data.terminate_conn = 0;
+					data.len = line_len - i < segment ?
+							   line_len - i :
+							   segment;
+					memcpy(data.char_seq, line + i, data.len);
+					/** Wait for the acks when the send buffer is full, waking the sender up for what is queued */
+					if (curr_conn->queue.size >=
+					    curr_conn->queue.limit) {
+						wake_sender(curr_conn);
+						wait_queue_space(&curr_conn->queue);
+					}
+					add_packet(&curr_conn->queue, &data);
+					log_print(TRACE, "Adding %d bytes to data", data.len);
+				}
+				if (curr_conn->queue.size >= 1) {
+					/** Send packets arrived signal to the sender */
+					wake_sender(curr_conn);
+				}
 			}
+			free(line);
+			line = 0;
+			line_len = 0;
 		}
-		free(line);
-		line = 0;
-		line_len = 0;
 	}
 
-	log_print(LOG, "Starting termination");
-	/** If consecutive enters are read, add termination packet to all queues */
+	log_print(INFO, "Starting termination");
+	/** If consecutive enters are read, add termination packet to all queues.
+	 * Hold the global mutex, the shards may add connections meanwhile. */
+	pthread_mutex_lock(&mutex);
 	struct connection_t *conn = curr_conn;
 	while (conn) {
-		struct packet_data term;
-		term.terminate_conn = 1;
+		struct packet_data term = { .terminate_conn = 1 };
 		free_queue(&conn->queue); /** Flush remaining elements */
 		add_packet(&conn->queue, &term);
 
-		/** Send signal again if sending thread is waiting */
-		pthread_mutex_lock(&mutex);
-		pthread_cond_signal(&conn->cond);
-		pthread_mutex_unlock(&mutex);
+		/** Send signal again if the sender is waiting */
+		wake_sender(conn);
 
 		conn = conn->next; /** For connections after the current connection */
 	}
 	conn = curr_conn;
 	while (conn) {
-		struct packet_data term;
-		term.terminate_conn = 1;
+		struct packet_data term = { .terminate_conn = 1 };
 		free_queue(&conn->queue); /** Flush remaining elements */
 		add_packet(&conn->queue, &term);
 
-		/** Send signal again if sending thread is waiting */
+		/** Send signal again if the sender is waiting */
+		wake_sender(conn);
+
+		conn = conn->prev; /** For connections before the current connection */
+	}
+	pthread_mutex_unlock(&mutex);
+
+	pthread_exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Adds the given connection to the held ack list of the given shard if it is not there
+ * 
+ * @param shard 
+ * @param conn 
+ */
+void hold_ack(struct shard *shard, struct connection_t *conn)
+{
+	if (!shard->ack_deadline || conn->delayed.deadline < shard->ack_deadline)
+		shard->ack_deadline = conn->delayed.deadline;
+	if (conn->ack_held)
+		return;
+
+	conn->ack_held = 1;
+	conn->next_ack = shard->held_acks;
+	shard->held_acks = conn;
+}
+
+/**
+ * @brief Sends the held back acks of the given shard whose deadline passed and updates the earliest deadline of the rest
+ * 
+ * @details Connections whose ack is sent, or was covered by a later ack, leave the list.
+ * 
+ * @param shard 
+ * @param ack_tx 
+ */
+void send_held_acks(struct shard *shard, struct io_batch *ack_tx)
+{
+	uint64_t now = now_us();
+	if (!shard->held_acks || shard->ack_deadline > now)
+		return;
+
+	shard->ack_deadline = 0;
+	struct connection_t **link = &shard->held_acks;
+	while (*link) {
+		struct connection_t *conn = *link;
+		struct packet_data ack;
+		if (expired_ack(&conn->delayed, now, &ack)) {
+			/** The window is the one of now, not of when the ack was held back */
+			set_ack_payload(&ack, 0,
+					receive_window(conn->delivery,
+						       conn->seg_size));
+			if (io_send(shard->sockfd, ack_tx, &ack,
+				    (struct sockaddr *)&conn->target_addr,
+				    conn->target_addr_len) == -1)
+				log_print(ERROR, "Cannot send packet");
+		}
+
+		if (!conn->delayed.pending) {
+			conn->ack_held = 0;
+			*link = conn->next_ack;
+			continue;
+		}
+		if (!shard->ack_deadline ||
+		    conn->delayed.deadline < shard->ack_deadline)
+			shard->ack_deadline = conn->delayed.deadline;
+		link = &conn->next_ack;
+	}
+}
+
+/**
+ * @brief Handles a datagram received on the socket of the given shard. ACKs are added to the given batch.
+ * 
+ * @param shard 
+ * @param packet 
+ * @param bytes 
+ * @param client_addr 
+ * @param client_addr_len 
+ * @param ack_tx 
+ */
+void handle_packet(struct shard *shard, struct packet_data *packet,
+		   size_t bytes, struct sockaddr *client_addr,
+		   socklen_t client_addr_len, struct io_batch *ack_tx)
+{
+	/** Drop the packet if the datagram is shorter than its header and payload, io_recv sets the length of invalid ones to 0 */
+	if (bytes < WIRE_HEADER_SIZE || wire_size(packet) > bytes) {
+		log_print(INFO, "Malformed packet, ignoring");
+		stat_add(unmatched_stats.packets, 1);
+		stat_add(unmatched_stats.bytes, bytes);
+		return;
+	}
+
+	/** If a packet is received, look up for its source in the connection table of the shard. */
+	struct connection_t *conn =
+		find_connection(&shard->conn_table, client_addr);
+	if (!conn) {
+		int err = 0;
+		/** Closed connections leave the table, a terminate packet resent after its ack was lost is acked again without one */
+		if (packet->terminate_conn && !packet->is_ack) {
+			struct packet_data ack;
+			memset(&ack, 0, PACKET_HEADER_SIZE);
+			ack.is_ack = ack.terminate_conn = 1;
+			ack.seq_num = packet->seq_num + 1;
+			set_ack_payload(&ack, 0, options.window);
+			if (io_send(shard->sockfd, ack_tx, &ack, client_addr,
+				    client_addr_len) == -1)
+				log_print(ERROR, "Cannot send packet");
+			return;
+		}
+		if (!packet->init_conn) {
+			/** If the source is unknown and not initiating, ignore */
+			log_print(INFO, "Packet from unknown origin, ignoring");
+			stat_add(unmatched_stats.packets, 1);
+			stat_add(unmatched_stats.bytes, bytes);
+			return;
+		} else if (terminate) {
+			log_print(INFO, "In termination sequence, ignoring");
+			stat_add(unmatched_stats.packets, 1);
+			stat_add(unmatched_stats.bytes, bytes);
+			return;
+		}
+
+		/** Use the smallest of the proposed segment size, ours and the path MTU.
+		 * The client's receive window limits what its sender thread sends. */
+		unsigned short path_size =
+			path_segment_size(client_addr, client_addr_len);
+		unsigned short seg_size, window;
+		get_handshake(packet, &seg_size, &window);
+		if (!seg_size || seg_size > options.segment_size)
+			seg_size = options.segment_size;
+		if (seg_size > path_size)
+			seg_size = path_size;
+
+		/** Initialize the connection by adding a new entry to the connection list, which is shared by the shards */
 		pthread_mutex_lock(&mutex);
-		pthread_cond_signal(&conn->cond);
+		first = 0;
+		last_conn = conn =
+			add_connection(last_conn, client_addr, client_addr_len);
+		conn->shard = shard->id;
+		conn->exp_seq_num++;
+		conn->seg_size = seg_size;
+		conn->delivery = claim_output() ? NULL : &shard->delivery;
+		if (conn->delivery)
+			attach_delivery(conn->delivery);
+		if (window)
+			conn->queue.peer_window = window;
+		int total = ++active_conn;
 		pthread_mutex_unlock(&mutex);
+		log_print(INFO,
+			  "New connection added to shard %d, total %d connections, segment size %d, window %u",
+			  shard->id, total, conn->seg_size,
+			  conn->queue.peer_window);
 
-		conn = conn->prev; /** For connections before the current connection */
+		insert_connection(&shard->conn_table, conn);
+
+		/** Create the thread for that sends packets to this client, the event core sends from the event loop */
+		if (options.core == CORE_THREADS &&
+		    (err = pthread_create(&conn->thread_id, 0, &send_packets,
+					  conn)))
+			log_print(ERROR, "Cannot create thread, error no %s",
+				  strerror(err));
+
+		/** Hand the connection to the input reader only once it is fully set up */
+		pthread_mutex_lock(&mutex);
+		if (!curr_conn)
+			curr_conn = conn;
+		if (!established) {
+			established = 1;
+			pthread_cond_broadcast(&established_cond);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+	stat_add(conn->recv_stats.packets, 1);
+	stat_add(conn->recv_stats.bytes, bytes);
+
+	/** Ack function (acknowledge_packet) explanation in conn.c */
+	if (packet->is_ack) {
+		log_print(TRACE, "Received ACK for packet %d", packet->seq_num);
+		/** If termination packet got an ack, end the program */
+		if (packet->terminate_conn && conn->is_active) {
+			/** Decrement and mark connection as not active. Its slot is reused by the next connection. */
+			conn->is_active = 0;
+			remove_connection(&shard->conn_table, conn);
+			if (conn->delivery)
+				detach_delivery(conn->delivery);
+			pthread_mutex_lock(&mutex);
+			active_conn--;
+			pthread_mutex_unlock(&mutex);
+			log_pool_stats(conn);
+			return;
+		}
+
+		int res = acknowledge_packet(&conn->queue, packet->seq_num - 1,
+					     get_ack_window(packet));
+		/** Selective Repeat acks also name the packet they acknowledge */
+		unsigned int sack = get_sack_seq(packet);
+		if (sack && selective_ack_packet(&conn->queue, sack) != -1)
+			res = sack;
+		if (res != -1 && options.core == CORE_EVENTS) {
+			/** The event loop sends the next batch after the received batch is handled */
+			pthread_mutex_lock(&shard->mutex);
+			mark_ready(shard, conn);
+			pthread_mutex_unlock(&shard->mutex);
+		} else if (res != -1) {
+			/** Signal the next batch of packets in the queue to be sent, acks before the sender wakes up are coalesced */
+			wakeup_signal(&conn->wakeup);
+		}
+		/** Since we just got an ack, return */
+		return;
+	}
+
+	/** If the packet is not an ack and has the expected sequence number, print it.
+	 * In Selective Repeat mode, the buffered packets following it are printed too,
+	 * and the packets ahead of the expected one are buffered.
+	 */
+	char terminated = 0;
+	int buffered = 0;
+	int delivered = 0;
+	if (conn->exp_seq_num == packet->seq_num) {
+		struct packet_data *next = packet;
+		do {
+			if (!next->init_conn)
+				write_output(conn->delivery, next->char_seq,
+					     next->len);
+			terminated |= next->terminate_conn;
+			conn->exp_seq_num++;
+			delivered++;
+		} while ((next = reorder_take(&conn->reorder, conn->exp_seq_num)));
+	} else if (options.mode == SELECTIVE_REPEAT) {
+		buffered = reorder_store(&conn->reorder, conn->exp_seq_num, packet);
+	}
+	/** A terminate packet that is delivered before is acked again */
+	if (packet->terminate_conn && conn->exp_seq_num > packet->seq_num)
+		terminated = 1;
+
+	/** Out of order packets are dropped in Go-Back-N mode, but still acked */
+	if (conn->exp_seq_num < packet->seq_num && !buffered) {
+		log_print(DEBUG, "Expected seq_num %d, got %d", conn->exp_seq_num,
+			  packet->seq_num);
+		stat_add(conn->recv_stats.out_of_order, 1);
+	} else if (buffered) {
+		stat_add(conn->recv_stats.buffered, 1);
+	}
+
+	/** Send cumulative ack for the packet. Out of order packets are acked too,
+	 * the duplicate cumulative acks make the sender retransmit the missing packet early. */
+	struct packet_data ack;
+	ack.is_ack = 1;
+	ack.seq_num = conn->exp_seq_num; /** Cumulative ack */
+	ack.init_conn = packet->init_conn;
+	ack.terminate_conn = terminated;
+	ack.len = 0;
+	/** The init ack tells the negotiated segment size and our receive window, the other acks the room left
+	 * for the client's packets, and a buffered packet is selectively acked */
+	if (ack.init_conn)
+		set_handshake(&ack, conn->seg_size, options.window);
+	else
+		set_ack_payload(&ack, buffered ? packet->seq_num : 0,
+				receive_window(conn->delivery,
+					       conn->seg_size));
+	if (terminated && conn->is_active) {
+		/** Initiate termination sequence if the last connection has closed */
+		pthread_mutex_lock(&mutex);
+		if (active_conn == 1)
+			terminate = 1;
+		else
+			active_conn--;
+		pthread_mutex_unlock(&mutex);
+		/** Mark the packet as not active, and free its slot. The connection is still used for the ack below. */
+		conn->is_active = 0;
+		remove_connection(&shard->conn_table, conn);
+		if (conn->delivery)
+			detach_delivery(conn->delivery);
+		log_pool_stats(conn);
+	}
+	/** Only a packet delivered in order on its own and without a gap after it may wait for the next one */
+	if (!delay_ack(&conn->delayed, &ack,
+		       delivered == 1 && !conn->reorder.count &&
+			       !ack.init_conn && !terminated)) {
+		hold_ack(shard, conn);
+		return;
+	}
+	/** ACKs of this batch are sent together after the batch is handled */
+	if (io_send(shard->sockfd, ack_tx, &ack,
+		    (struct sockaddr *)&conn->target_addr,
+		    conn->target_addr_len) == -1)
+		log_print(ERROR, "Cannot send packet");
+	log_print(TRACE, "Sent ACK for packet %d", ack.seq_num);
+}
+
+/**
+ * @brief Returns 1 if no shard received a datagram in the last 1s. Used in the termination sequence.
+ * 
+ * @param now 
+ * @return int 
+ */
+int shards_idle(uint64_t now)
+{
+	for (int i = 0; i < options.shards; i++)
+		if (now - shards[i].last_rx < 1000000)
+			return 0;
+
+	return 1;
+}
+
+/**
+ * @brief Arms the timer of the given shard at its earliest retransmission or held back ack deadline, or disarms it if nothing is waiting for one
+ * 
+ * @param shard 
+ */
+void arm_timer(struct shard *shard)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+
+	struct connection_t *conn = next_timer(&shard->timers);
+	uint64_t deadline = shard->ack_deadline;
+	if (conn && (!deadline || conn->deadline < deadline))
+		deadline = conn->deadline ? conn->deadline : 1;
+	if (deadline) {
+		/** A zero time disarms the timer, an expired deadline fires immediately either way */
+		its.it_value.tv_sec = deadline / 1000000;
+		its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	}
+
+	if (timerfd_settime(shard->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) ==
+	    -1)
+		log_print(ERROR, "Cannot set the retransmission timer");
+}
+
+/**
+ * @brief Sends the windows of the connections in the ready list of the given shard and schedules their next retransmission
+ * 
+ * @param shard 
+ * @param tx 
+ */
+void send_ready(struct shard *shard, struct io_batch *tx)
+{
+	while (1) {
+		/** Take the connections one by one, the input thread may add more meanwhile */
+		pthread_mutex_lock(&shard->mutex);
+		struct connection_t *conn = shard->ready_head;
+		if (conn) {
+			shard->ready_head = conn->next_ready;
+			if (!shard->ready_head)
+				shard->ready_tail = 0;
+			conn->ready = 0;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+		if (!conn)
+			return;
+
+		if (!conn->queue.size) {
+			unschedule_connection(&shard->timers, conn);
+			continue;
+		}
+
+		uint64_t deadline;
+		send_connection(conn, tx, &deadline);
+		schedule_connection(&shard->timers, conn, deadline);
 	}
+}
+
+/**
+ * @brief Creates the descriptors of the event core of the given shard and watches them with epoll. Must be called before the input thread starts.
+ * 
+ * @param shard 
+ */
+void init_events(struct shard *shard)
+{
+	if ((shard->epoll_fd = epoll_create1(0)) == -1 ||
+	    (shard->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) ==
+		    -1 ||
+	    (shard->event_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+		log_print(ERROR, "Cannot create the event loop");
+
+	int fds[] = { shard->sockfd, shard->timer_fd, shard->event_fd };
+	for (int i = 0; i < sizeof(fds) / sizeof(*fds); i++) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = fds[i] };
+		if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fds[i], &ev) == -1)
+			log_print(ERROR, "Cannot watch the event loop descriptors");
+	}
+	init_timer_heap(&shard->timers);
+}
+
+/**
+ * @brief Event core. Receives datagrams, sends the windows and retransmits for every connection of the given shard from one thread.
+ * 
+ * @details The socket, a timer armed at the earliest retransmission deadline and an eventfd written by the input thread
+ * are watched with epoll. Received acks and new input put the connection to the ready list, expired deadlines too,
+ * and the ready connections are sent after every wakeup. No thread is created per connection,
+ * so the number of connections is only limited by memory. Does not return.
+ * 
+ * @param shard 
+ */
+void event_loop(struct shard *shard)
+{
+	/** Received datagrams, the ACKs for them and the window packets are batched */
+	struct io_batch rx, ack_tx, tx;
+	io_batch_init(&rx, options.batch_size);
+	io_batch_init(&ack_tx, options.batch_size);
+	io_batch_init(&tx, options.batch_size);
+	/** Run until termination */
+	while (active_conn || first) {
+		/** If in termination sequence, wait for 1s for packets on any shard and if no packets arrive, terminate. */
+		int wait = -1;
+		if (terminate) {
+			uint64_t now = now_us();
+			if (shards_idle(now)) {
+				log_print(INFO, "No connections left, exiting");
+				exit(0);
+			}
+			wait = (1000000 - (now - shard->last_rx)) / 1000 + 1;
+			if (wait > 1000)
+				wait = 1000;
+		}
+
+		struct epoll_event events[3];
+		int n = epoll_wait(shard->epoll_fd, events,
+				   sizeof(events) / sizeof(*events), wait);
+		if (n == -1 && errno != EINTR)
+			log_print(ERROR, "Cannot wait for events");
+
+		for (int e = 0; e < n; e++) {
+			int fd = events[e].data.fd;
+			if (fd == shard->sockfd) {
+				/** Drain up to a batch of datagrams, the socket stays readable if more are queued.
+				 * Their ACKs are sent with one call after the events are handled. */
+				if (io_recv(shard->sockfd, &rx) == -1)
+					log_print(ERROR, "Cannot read from socket");
+				shard->last_rx = now_us();
+				for (int r = 0; r < rx.count; r++) {
+					log_print(TRACE, "%d bytes received",
+						  rx.msgs[r].msg_len);
+					handle_packet(
+						shard, &rx.packets[r],
+						rx.msgs[r].msg_len,
+						(struct sockaddr *)&rx.addrs[r],
+						rx.msgs[r].msg_hdr.msg_namelen,
+						&ack_tx);
+				}
+
+			} else if (fd == shard->timer_fd) {
+				/** Every connection whose deadline passed is sent again */
+				uint64_t expirations;
+				if (read(shard->timer_fd, &expirations,
+					 sizeof(expirations)) == -1 &&
+				    errno != EAGAIN)
+					log_print(ERROR, "Cannot read the timer");
+				uint64_t now = now_us();
+				struct connection_t *conn;
+				while ((conn = next_timer(&shard->timers)) &&
+				       conn->deadline <= now) {
+					unschedule_connection(&shard->timers,
+							      conn);
+					log_print(DEBUG,
+						  "Timed out, sending packages again");
+					pthread_mutex_lock(&shard->mutex);
+					mark_ready(shard, conn);
+					pthread_mutex_unlock(&shard->mutex);
+				}
+			} else {
+				/** The input thread added packets */
+				eventfd_t value;
+				if (eventfd_read(shard->event_fd, &value) == -1 &&
+				    errno != EAGAIN)
+					log_print(ERROR, "Cannot read the wakeup");
+			}
+		}
+
+		/** Held back acks are sent when their deadline passes */
+		send_held_acks(shard, &ack_tx);
+		if (io_flush(shard->sockfd, &ack_tx) == -1)
+			log_print(ERROR, "Cannot send packet");
+
+		send_ready(shard, &tx);
+		arm_timer(shard);
+	}
+
+	log_print(INFO, "No connections left, exiting");
+	exit(0);
+}
+
+/**
+ * @brief Thread core. Receives datagrams of the given shard and handles them, the connections send from their own threads. Does not return.
+ * 
+ * @param shard 
+ */
+void receive_loop(struct shard *shard)
+{
+	/** Received datagrams and the ACKs for them are batched */
+	struct io_batch rx, ack_tx;
+	io_batch_init(&rx, options.batch_size);
+	io_batch_init(&ack_tx, options.batch_size);
+	/** Socket timeout, set while acks are held back or in the termination sequence */
+	uint64_t timeout = 0;
+	/** Run until termination */
+	while (active_conn || first) {
+		/** Wake up for the held back acks. The timeout is only changed when the shard starts or stops
+		 * holding acks back, so an ack waits at most twice the ack delay.
+		 * If in termination sequence, set the socket timeout to 1s.
+		 * Wait for 1s for packets on any shard and if no packets arrive, terminate.
+		 */
+		uint64_t wait = 0;
+		if (shard->held_acks)
+			wait = options.ack_delay + 1;
+		else if (terminate)
+			wait = 1000000;
+		if (wait != timeout && io_timeout(shard->sockfd, wait) == -1)
+			log_print(ERROR, "Cannot set timeout");
+		timeout = wait;
+
+		/** Wait for packets, drain up to a batch of them at once */
+		if (io_recv(shard->sockfd, &rx) == -1) {
+			if (!terminate && errno != EAGAIN)
+				log_print(ERROR, "Cannot read from socket");
+			/** No packets arrived since the last 1s, assuming the ack is arrived to the client. */
+			if (terminate && shards_idle(now_us())) {
+				log_print(INFO, "No connections left, exiting");
+				exit(0);
+			}
+		} else {
+			shard->last_rx = now_us();
+		}
+
+		for (int r = 0; r < rx.count; r++) {
+			log_print(TRACE, "%d bytes received", rx.msgs[r].msg_len);
+			handle_packet(shard, &rx.packets[r], rx.msgs[r].msg_len,
+				      (struct sockaddr *)&rx.addrs[r],
+				      rx.msgs[r].msg_hdr.msg_namelen, &ack_tx);
+		}
+
+		/** Send the ACKs of the batch and the expired held back ones with one call */
+		send_held_acks(shard, &ack_tx);
+		if (io_flush(shard->sockfd, &ack_tx) == -1)
+			log_print(ERROR, "Cannot send packet");
+	}
+
+	log_print(INFO, "No connections left, exiting");
+	exit(0);
+}
+
+/**
+ * @brief Serves the given shard with the configured core. Shard threads start here, the main thread serves the first shard.
+ * 
+ * @param args 
+ * @return void* 
+ */
+void *run_shard(void *args)
+{
+	struct shard *shard = (struct shard *)args;
+	log_print(INFO, "Shard %d ready for connections", shard->id);
+
+	if (options.core == CORE_EVENTS)
+		event_loop(shard);
+	else
+		receive_loop(shard);
 
 	pthread_exit(EXIT_SUCCESS);
 }
 
+/**
+ * @brief Creates the socket of the given shard and binds it to the given address.
+ * With more than one shard the sockets share the port with SO_REUSEPORT.
+ * 
+ * @param shard 
+ * @param addr 
+ */
+void bind_shard(struct shard *shard, struct addrinfo *addr)
+{
+	int yes = 1;
+	if ((shard->sockfd = socket(addr->ai_family, addr->ai_socktype,
+				    addr->ai_protocol)) == -1)
+		log_print(ERROR, "Cannot initialize socket");
+
+	if (setsockopt(shard->sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
+		       sizeof(int)) == -1 ||
+	    (options.shards > 1 &&
+	     setsockopt(shard->sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+			sizeof(int)) == -1))
+		log_print(ERROR, "Cannot configure socket");
+
+	if (bind(shard->sockfd, addr->ai_addr, addr->ai_addrlen) == -1) {
+		close(shard->sockfd);
+		log_print(ERROR, "Cannot bind to port");
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	/** Get arguments */
 	char *server_port = 0;
-	if (argc != 2)
-		log_print(ERROR, "Wrong argument count\nUsage: <server-port>");
+	int arg = parse_options(argc, argv);
+	if (arg == -1 || argc - arg != 1)
+		log_print(ERROR,
+			  "Wrong arguments\nUsage: [options] <server-port>\n" OPTIONS_HELP);
 	else
-		server_port = argv[1];
+		server_port = argv[arg];
+
+	/** Print the counters on SIGUSR1, before the other threads are created so they do not take the signal */
+	start_stats_thread(dump_stats);
+	/** Start the log writer, packets are logged from the hot path */
+	log_init(options.log_level);
+
+	if (options.file && map_file(options.file, &input) == -1)
+		log_print(ERROR, "Cannot map %s", options.file);
+	if (options.output && open_output(options.output) == -1)
+		log_print(ERROR, "Cannot open %s", options.output);
 
 	/** Socket init-configuration start */
 
@@ -225,23 +972,22 @@ int main(int argc, char *argv[])
 	if (getaddrinfo(NULL, server_port, &hints, &res) == -1)
 		log_print(ERROR, "Cannot get port %s info", server_port);
 
-	int yes = 1;
-	if ((sockfd = socket(res->ai_family, res->ai_socktype,
-			     res->ai_protocol)) == -1)
-		log_print(ERROR, "Cannot initialize socket");
-	log_print(LOG, "Socket at port %s initialized", server_port);
-
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) ==
-	    -1)
-		log_print(ERROR, "Cannot configure socket");
-	log_print(LOG, "Socket configured");
-
-	if (bind(sockfd, res->ai_addr, res->ai_addrlen) == -1) {
-		close(sockfd);
-		log_print(ERROR, "Cannot bind to port");
+	/** Every shard has its own socket, connection table, delivery buffer and lock */
+	shards = calloc(options.shards, sizeof(struct shard));
+	for (int i = 0; i < options.shards; i++) {
+		struct shard *shard = &shards[i];
+		shard->id = i;
+		bind_shard(shard, res);
+		pthread_mutex_init(&shard->mutex, NULL);
+		init_connection_table(&shard->conn_table);
+		init_delivery(&shard->delivery);
+		shard->last_rx = now_us();
+		if (options.core == CORE_EVENTS)
+			init_events(shard);
 	}
 	freeaddrinfo(res);
-	log_print(LOG, "Ready for connections");
+	log_print(INFO, "%d sockets at port %s initialized", options.shards,
+		  server_port);
 
 	/** Socket init-configuration end */
 
@@ -252,141 +998,15 @@ int main(int argc, char *argv[])
 		log_print(ERROR, "Cannot create thread, error no %s",
 			  strerror(err));
 
-	/** Initialize the connection list and helper variables */
-	struct connection_t *conn_list_head = 0;
-	struct connection_t *last_conn = 0;
-	struct packet_data packet;
-	/** Run until termination */
-	char first = 1;
-	while (active_conn || first) {
-		struct sockaddr_storage client_addr;
-		socklen_t client_addr_len = sizeof(client_addr);
-
-		/** If in termination sequence, set the socket timeout to 1s.
-		 * Wait for 1s for packets and if no packets arrive, terminate.
-		 */
-		if (terminate) {
-			struct timeval tv;
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
-				       sizeof(tv)) == -1)
-				log_print(ERROR, "Cannot set timeout");
-		}
-
-		/** Wait for packets */
-		int bytes_transmitted = 0;
-		if ((bytes_transmitted = recvfrom(
-			     sockfd, &packet, sizeof(struct packet_data), 0,
-			     (struct sockaddr *)&client_addr,
-			     &client_addr_len)) == -1 &&
-		    !terminate) {
-			log_print(ERROR, "Cannot read from socket");
-		} else if (bytes_transmitted == -1) {
-			/** No packets arrived since the last 1s, assuming the ack is arrived to the client. */
-			log_print(LOG, "No connections left, exiting");
-			exit(0);
-		}
-		log_print(LOG, "%d bytes received", bytes_transmitted);
-
-		/** If a packet is received, look up for its source in the connection list. */
-		struct connection_t *conn = 0;
-		if (!(conn = find_connection(conn_list_head,
-					     (struct sockaddr *)&client_addr))) {
-			if (!packet.init_conn) {
-				/** If the source is unknown and not initiating, ignore */
-				log_print(
-					LOG,
-					"Packet from unknown origin, ignoring");
-				continue;
-			} else if (terminate) {
-				log_print(LOG,
-					  "In termination sequence, ignoring");
-				continue;
-			}
-			first = 0;
-
-			/** Initialize the connection by adding a new entry to the connection list */
-			last_conn = conn = add_connection(
-				last_conn, (struct sockaddr *)&client_addr,
-				client_addr_len);
-			conn->exp_seq_num++;
-			active_conn++;
-			log_print(LOG,
-				  "New connection added, total %d connections",
-				  active_conn);
-
-			if (!conn_list_head)
-				conn_list_head = curr_conn = last_conn;
-
-			/** Create the thread for that sends packets to this client */
-			if ((err = pthread_create(&last_conn->thread_id, 0,
-						  &send_packets, last_conn)))
-				log_print(ERROR,
-					  "Cannot create thread, error no %s",
-					  strerror(err));
-		}
-
-		/** Ack function (acknowledge_packet) explanation in conn.c */
-		if (packet.is_ack) {
-			log_print(LOG, "Received ACK for packet %d",
-				  packet.seq_num);
-			/** If termination packet got an ack, end the program */
-			if (packet.terminate_conn && conn->is_active) {
-				/** Decrement and mark connection as not active. */
-				conn->is_active = 0;
-				active_conn--;
-				continue;
-			}
-
-			int res = acknowledge_packet(
-				&conn->queue, packet.seq_num - 1, &mutex);
-			if (res != -1) {
-				/** Signal the next batch of packets in the queue to be sent */
-				pthread_mutex_lock(&conn->timeout_mutex);
-				pthread_cond_signal(&conn->timeout_cond);
-				pthread_mutex_unlock(&conn->timeout_mutex);
-			}
-			/** Since we just got an ack, continue */
-			continue;
-		}
-
-		/** If the packet is not an ack and has the expected sequence number, print it */
-		if (conn->exp_seq_num == packet.seq_num) {
-			if (!packet.init_conn)
-				printf("%s", packet.char_seq);
-			conn->exp_seq_num++;
-		}
-
-		/** Send cumulative ack for the packet */
-		if (conn->exp_seq_num > packet.seq_num) {
-			struct packet_data ack;
-			ack.is_ack = 1;
-			ack.seq_num = conn->exp_seq_num; /** Cumulative ack */
-			ack.init_conn = packet.init_conn;
-			ack.terminate_conn = packet.terminate_conn;
-			if (packet.terminate_conn) {
-				/** Initiate termination sequence if the last connection has closed */
-				if (active_conn == 1)
-					terminate = 1;
-				else
-					active_conn--;
-				/** Mark the packet as not active */
-				conn->is_active = 0;
-			}
-			int ack_bytes = 0;
-			if ((ack_bytes = sendto(sockfd, &ack,
-						sizeof(struct packet_data), 0,
-						&conn->target_addr,
-						conn->target_addr_len)) == -1)
-				log_print(ERROR, "Cannot send packet");
-			log_print(LOG, "Sent ACK for packet %d", ack.seq_num);
-		} else {
-			log_print(LOG, "Expected seq_num %d, got %d",
-				  conn->exp_seq_num, packet.seq_num);
-		}
-	}
-
-	log_print(LOG, "No connections left, exiting");
-	exit(0);
+	/** The other shards get their own threads, the main thread serves the first one.
+	 * In the event core a shard serves all of its connections from its thread,
+	 * otherwise each connection gets a sender thread. */
+	for (int i = 1; i < options.shards; i++)
+		if ((err = pthread_create(&shards[i].thread_id, 0, &run_shard,
+					  &shards[i])))
+			log_print(ERROR, "Cannot create thread, error no %s",
+				  strerror(err));
+	run_shard(&shards[0]);
+
+	return EXIT_SUCCESS;
 }
@@ -0,0 +1,194 @@
+/**
+ * @file stats.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Transport counters implementation
+ * 
+ * @details The counters are updated with relaxed atomics on the packet path and read only when a snapshot is asked.
+ * Sending SIGUSR1 to the process prints a JSON snapshot to stderr, e.g. kill -USR1 $(pidof server).
+ * 
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "stats.h"
+
+/**
+ * @brief Counts a round trip time sample in its histogram bucket
+ * 
+ * @param stats 
+ * @param sample 
+ */
+void stat_rtt(struct send_stats *stats, uint64_t sample)
+{
+	int bucket = 0;
+	uint64_t limit = 100;
+	while (bucket < RTT_BUCKETS - 1 && sample >= limit) {
+		bucket++;
+		limit <<= 1;
+	}
+	stat_add(stats->rtt[bucket], 1);
+}
+
+/**
+ * @brief Prints the send counters as JSON members
+ * 
+ * @param out 
+ * @param stats 
+ */
+static void print_send(FILE *out, struct send_stats *stats)
+{
+	fprintf(out,
+		"\"sent\":{\"packets\":%lu,\"bytes\":%lu,\"retransmissions\":%lu,"
+		"\"timeouts\":%lu,\"fast_retransmits\":%lu,\"dup_acks\":%lu,"
+		"\"paced\":%lu,\"probes\":%lu},\"rtt_us\":{",
+		stat_get(stats->packets), stat_get(stats->bytes),
+		stat_get(stats->retransmissions), stat_get(stats->timeouts),
+		stat_get(stats->fast_retransmits), stat_get(stats->dup_acks),
+		stat_get(stats->paced), stat_get(stats->probes));
+	/** Buckets are named by their upper bound, the last one is unbounded */
+	for (int i = 0; i < RTT_BUCKETS; i++) {
+		if (i < RTT_BUCKETS - 1)
+			fprintf(out, "\"<%lu\":", 100UL << i);
+		else
+			fprintf(out, "\"inf\":");
+		fprintf(out, "%lu%s", stat_get(stats->rtt[i]),
+			i < RTT_BUCKETS - 1 ? "," : "}");
+	}
+}
+
+/**
+ * @brief Prints the receive counters as JSON members
+ * 
+ * @param out 
+ * @param recv 
+ */
+static void print_recv(FILE *out, struct recv_stats *recv)
+{
+	fprintf(out,
+		"\"received\":{\"packets\":%lu,\"bytes\":%lu,\"out_of_order\":%lu,\"buffered\":%lu}",
+		stat_get(recv->packets), stat_get(recv->bytes),
+		stat_get(recv->out_of_order), stat_get(recv->buffered));
+}
+
+/**
+ * @brief Prints the counters and the current window of a connection as a JSON object
+ * 
+ * @details The queue is read without its lock, so the depth and the windows are only approximate.
+ * 
+ * @param out 
+ * @param id 
+ * @param queue 
+ * @param recv 
+ */
+void print_stats(FILE *out, int id, struct packet_queue *queue,
+		 struct recv_stats *recv)
+{
+	fprintf(out,
+		"{\"id\":%d,\"queue\":{\"depth\":%d,\"window\":%u,\"cwnd\":%u,\"srtt_us\":%lu,\"rto_us\":%lu},",
+		id, queue->size, queue->peer_window, queue->cc.cwnd,
+		(unsigned long)queue->rtt.srtt, (unsigned long)queue->rtt.rto);
+	print_send(out, &queue->stats);
+	fprintf(out, ",");
+	print_recv(out, recv);
+	fprintf(out, "}");
+}
+
+/**
+ * @brief Adds the counters of a connection to the totals
+ * 
+ * @param total 
+ * @param total_recv 
+ * @param stats 
+ * @param recv 
+ */
+void add_stats(struct send_stats *total, struct recv_stats *total_recv,
+	       struct send_stats *stats, struct recv_stats *recv)
+{
+	stat_add(total->packets, stat_get(stats->packets));
+	stat_add(total->bytes, stat_get(stats->bytes));
+	stat_add(total->retransmissions, stat_get(stats->retransmissions));
+	stat_add(total->timeouts, stat_get(stats->timeouts));
+	stat_add(total->fast_retransmits, stat_get(stats->fast_retransmits));
+	stat_add(total->dup_acks, stat_get(stats->dup_acks));
+	stat_add(total->paced, stat_get(stats->paced));
+	stat_add(total->probes, stat_get(stats->probes));
+	for (int i = 0; i < RTT_BUCKETS; i++)
+		stat_add(total->rtt[i], stat_get(stats->rtt[i]));
+
+	stat_add(total_recv->packets, stat_get(recv->packets));
+	stat_add(total_recv->bytes, stat_get(recv->bytes));
+	stat_add(total_recv->out_of_order, stat_get(recv->out_of_order));
+	stat_add(total_recv->buffered, stat_get(recv->buffered));
+}
+
+/**
+ * @brief Prints the summed counters as a JSON object
+ * 
+ * @param out 
+ * @param total 
+ * @param total_recv 
+ */
+void print_totals(FILE *out, struct send_stats *total,
+		  struct recv_stats *total_recv)
+{
+	fprintf(out, "{");
+	print_send(out, total);
+	fprintf(out, ",");
+	print_recv(out, total_recv);
+	fprintf(out, "}");
+}
+
+/**
+ * @brief Stats thread. Waits for SIGUSR1 and prints the snapshot built by the program with one write.
+ * 
+ * @param args 
+ * @return void* 
+ */
+static void *stats_thread(void *args)
+{
+	void (*dump)(FILE *out) = (void (*)(FILE *))args;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	while (1) {
+		int sig;
+		if (sigwait(&set, &sig))
+			continue;
+
+		char *buf = 0;
+		size_t len = 0;
+		FILE *out = open_memstream(&buf, &len);
+		if (!out)
+			continue;
+		dump(out);
+		fprintf(out, "\n");
+		fclose(out);
+		write(STDERR_FILENO, buf, len);
+		free(buf);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Blocks SIGUSR1 and starts the thread that prints a snapshot when it arrives.
+ * Must be called before the other threads are created, they inherit the blocked signal.
+ * 
+ * @param dump Prints the snapshot of the program 
+ */
+void start_stats_thread(void (*dump)(FILE *out))
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, 0);
+
+	pthread_t thread;
+	if (!pthread_create(&thread, 0, &stats_thread, (void *)dump))
+		pthread_detach(thread);
+}
@@ -0,0 +1,75 @@
+/**
+ * @file stats.h
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Transport counters and their snapshot.
+ * 
+ */
+
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/** Buckets of the RTT histogram. Bucket i counts the samples below 2^i * 100us, the last one the rest. */
+#define RTT_BUCKETS 16
+
+/**
+ * @struct send_stats
+ * 
+ * @brief Counters of a packet queue, updated by its sender.
+ * 
+ */
+struct send_stats {
+	/** Data packets put on the wire and their bytes, retransmissions included */
+	atomic_ulong packets;
+	atomic_ulong bytes;
+	/** Packets sent more than once */
+	atomic_ulong retransmissions;
+	/** Retransmission timeouts and fast retransmits of the window */
+	atomic_ulong timeouts;
+	atomic_ulong fast_retransmits;
+	/** Duplicate cumulative acks received */
+	atomic_ulong dup_acks;
+	/** Times the pacer held back the rest of a due window */
+	atomic_ulong paced;
+	/** Zero window probes sent while the peer had no room for more packets */
+	atomic_ulong probes;
+	/** Round trip time samples */
+	atomic_ulong rtt[RTT_BUCKETS];
+};
+
+/**
+ * @struct recv_stats
+ * 
+ * @brief Counters of the datagrams received from a peer.
+ * 
+ */
+struct recv_stats {
+	/** Datagrams received and their bytes, acks included */
+	atomic_ulong packets;
+	atomic_ulong bytes;
+	/** Out of order packets dropped in Go-Back-N mode or outside the Selective Repeat window */
+	atomic_ulong out_of_order;
+	/** Out of order packets buffered in Selective Repeat mode */
+	atomic_ulong buffered;
+};
+
+/** Counters are only summed up by the snapshot, so no ordering is needed */
+#define stat_add(counter, n) \
+	atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define stat_get(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+/** These functions will be explained in stats.c */
+struct packet_queue;
+void stat_rtt(struct send_stats *stats, uint64_t sample);
+void print_stats(FILE *out, int id, struct packet_queue *queue,
+		 struct recv_stats *recv);
+void add_stats(struct send_stats *total, struct recv_stats *total_recv,
+	       struct send_stats *stats, struct recv_stats *recv);
+void print_totals(FILE *out, struct send_stats *total,
+		  struct recv_stats *total_recv);
+void start_stats_thread(void (*dump)(FILE *out));
+
+#endif // !__STATS__
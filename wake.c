@@ -0,0 +1,66 @@
+/**
+ * @file wake.c
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Sender wakeup implementation
+ * 
+ * @details The waiter marks the wakeup waiting and sleeps on the futex until the state changes or the deadline passes.
+ * Deadlines are absolute CLOCK_MONOTONIC times, which FUTEX_WAIT_BITSET waits for,
+ * so changes of the wall clock do not move the retransmissions.
+ * 
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wake.h"
+
+/**
+ * @brief Signals the given wakeup. Wakes the waiter up if it sleeps, otherwise the next wait returns right away.
+ * 
+ * @param wakeup 
+ */
+void wakeup_signal(struct wakeup *wakeup)
+{
+	if (atomic_exchange(&wakeup->state, WAKEUP_PENDING) == WAKEUP_WAITING)
+		syscall(SYS_futex, &wakeup->state, FUTEX_WAKE_PRIVATE, 1, NULL,
+			NULL, 0);
+}
+
+/**
+ * @brief Waits for a signal of the given wakeup or until the given monotonic deadline in microseconds, 0 to wait without one.
+ * Returns 1 if signaled, including a signal sent before the call, and 0 if the deadline passed.
+ * 
+ * @details Only one thread may wait on a wakeup.
+ * 
+ * @param wakeup 
+ * @param deadline 
+ * @return int 
+ */
+int wakeup_wait(struct wakeup *wakeup, uint64_t deadline)
+{
+	/** Take a pending signal, or mark the wakeup waiting so the next signal wakes the futex up */
+	unsigned int state = WAKEUP_IDLE;
+	if (!atomic_compare_exchange_strong(&wakeup->state, &state,
+					    WAKEUP_WAITING)) {
+		atomic_store(&wakeup->state, WAKEUP_IDLE);
+		return 1;
+	}
+
+	struct timespec ts = { .tv_sec = deadline / 1000000,
+			       .tv_nsec = (deadline % 1000000) * 1000 };
+	while (atomic_load(&wakeup->state) == WAKEUP_WAITING) {
+		/** Returns when signaled, at once if the signal came before the sleep, and on interrupts */
+		if (syscall(SYS_futex, &wakeup->state,
+			    FUTEX_WAIT_BITSET_PRIVATE, WAKEUP_WAITING,
+			    deadline ? &ts : NULL, NULL,
+			    FUTEX_BITSET_MATCH_ANY) == -1 &&
+		    errno == ETIMEDOUT)
+			break;
+	}
+
+	/** A signal that came with the timeout is taken too */
+	return atomic_exchange(&wakeup->state, WAKEUP_IDLE) == WAKEUP_PENDING;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file wake.h
+ * @author Burak Köroğlu (e2448637@ceng.metu.edu.tr)
+ * @brief Sender wakeup interface.
+ * 
+ */
+
+#ifndef __WAKE__
+#define __WAKE__
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/** States of a wakeup */
+#define WAKEUP_IDLE 0
+#define WAKEUP_PENDING 1
+#define WAKEUP_WAITING 2
+
+/**
+ * @struct wakeup
+ * 
+ * @brief A flag that wakes up one waiting thread, built on a futex.
+ * 
+ * @details A signal stays pending until the waiter takes it, so a signal sent before the wait is not lost,
+ * and the signals sent before the waiter takes them are coalesced into one wakeup.
+ * Only a signal that finds the waiter asleep makes a system call.
+ * Zero initialized is idle.
+ * 
+ */
+struct wakeup {
+	/** WAKEUP_IDLE, WAKEUP_PENDING or WAKEUP_WAITING */
+	atomic_uint state;
+};
+
+/** These functions will be explained in wake.c */
+void wakeup_signal(struct wakeup *wakeup);
+int wakeup_wait(struct wakeup *wakeup, uint64_t deadline);
+
+#endif // !__WAKE__